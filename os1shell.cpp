@@ -13,12 +13,33 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 #include <iostream>
 #include <signal.h>
 #include <time.h>
 #include <stdbool.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <poll.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 
 using namespace std;
@@ -30,10 +51,48 @@ unsigned int RESERVE_CLUSTER = 0xFFFE;
 unsigned int LAST_CLUSTER = 0xFFFF;
 unsigned int FREE_CLUSTER = 0x0000;
 unsigned int DELETED_FILE = 0xFF;
+unsigned int TYPE_FILE = 0x00;
+unsigned int TYPE_DIRECTORY = 0x01;
+unsigned int TYPE_MASK = 0xFF; // the low byte of type is the kind of entry,
+unsigned int TYPE_SHARED = 0x100; // the rest are flags
+unsigned int TYPE_COMPRESSED = 0x200;
+unsigned int TYPE_INLINE = 0x400; // data kept in the entry, after the name
 unsigned int DEFAULT_CSIZE = 8; // in KB
 unsigned int DEFAULT_SIZE = 10; // in MB
+unsigned int MAX_SIZE = 16384; // in MB
 unsigned int MEGABYTE = 1024*1024;
 unsigned int KILOBYTE = 1024;
+unsigned int EMPTY_SLOT = 0xFFFFFFFF;
+unsigned int DIRTY_PAGE = 4096; // table writeback granularity, in bytes
+unsigned int DEFAULT_CACHE = 4096; // cluster cache budget, in KB
+unsigned int COPY_CHUNK = 1024*1024; // bulk copy buffer, in bytes
+unsigned int JOURNAL_KB = 256; // metadata journal on new filesystems, in KB
+unsigned int JOURNAL_MAGIC = 0x4A4E4C31; // "JNL1"
+unsigned int FORMAT_V2 = 2; // 32-bit FAT markers, size kept in clusters
+unsigned int DIR_MAGIC = 0x44495231; // "DIR1", every cluster but the last full
+unsigned int DIR_SLACK_MAGIC = 0x44495232; // "DIR2", clusters with room to spare
+unsigned int JOURNAL_DIR_PAGE = 0x80000000; // journal page list tags
+unsigned int JOURNAL_CLUSTER = 0x40000000;
+unsigned int JOURNAL_SUM_PAGE = 0xC0000000;
+unsigned int JOURNAL_TAGS = 0xC0000000;
+unsigned int PAGE_DIRTY = 0x01; // changed since the last commit
+unsigned int PAGE_LOGGED = 0x02; // committed to the journal, not written home
+unsigned int FSCK_FREE = 0x01; // the entry points at a free cluster
+unsigned int FSCK_BROKEN = 0x02; // the chain runs into a free or bad cluster
+unsigned int FSCK_LOOP = 0x04; // the chain comes back on itself
+unsigned int FSCK_CROSS = 0x08; // the chain runs into another one
+unsigned int FSCK_SIZE = 0x10; // the chain is the wrong length for the size
+unsigned int FSCK_HEADER = 0x20; // a subdirectory without a valid header
+unsigned int FSCK_CHECKSUM = 0x40; // data that doesn't match its checksums
+unsigned int FSCK_THREADS = 16; // most threads the checker will use
+unsigned int IMPORT_THREADS = 16; // most threads cp -r will use
+unsigned int PACK_MAGIC = 0x4B434150; // "PACK"
+unsigned int PACK_BLOCK = 65536; // compressed files are packed this much at a time
+unsigned int PACK_STORED = 0x80000000; // a block that didn't compress
+unsigned int LZ_HASH_BITS = 14; // the compressor remembers 2^bits positions
+unsigned int SERVER_CLIENTS = 64; // most shells a server takes at once
+unsigned int SERVER_MSG = 4096; // longest command a server will take
+unsigned int SERVER_STALL = 10; // seconds a client's output can stay full
 
 // a node struct for our doubly-linked list
 typedef struct node{
@@ -47,6 +106,13 @@ typedef struct mbr{
 	unsigned int disk_size;
 	unsigned int dir_table_index;
 	unsigned int FAT_index;
+	unsigned int magic; // JOURNAL_MAGIC if the journal fields are valid
+	unsigned int journal_index;
+	unsigned int journal_clusters;
+	unsigned int journal_sequence; // first transaction not yet checkpointed
+	unsigned int version; // FORMAT_V2, or 0 for the original format
+	unsigned int cluster_count; // v2 only; disk_size stops at 4GB
+	unsigned int checksum_index; // v2 only; 0 if there's no checksum table
 };
 
 typedef struct directory{
@@ -57,12 +123,347 @@ typedef struct directory{
 	unsigned int timestamp;
 };
 
+// the first slot of a subdirectory's first cluster; the directory's entries
+// follow it in name order.  Each cluster's entries are packed at its front,
+// with whatever room is left after them, and every name in a cluster sorts 
+// before those of the next, so an entry only ever moves within its cluster
+// (or into a new one split off after it).  A DIR1 directory kept every 
+// cluster but the last full and counted its entries; a DIR2 one counts its
+// clusters instead, which only changes when one is split off or emptied
+typedef struct dir_header{
+	unsigned int magic;
+	unsigned int count; // entries, DIR1 only
+	unsigned int blocks; // clusters, DIR2 only
+	char unused[sizeof(directory) - 3 * sizeof(unsigned int)];
+};
+
+// where a directory entry lives: dir is MAX_FILES for a slot of the root
+// directory table, otherwise the first cluster of the subdirectory holding it
+typedef struct entry_ref{
+	unsigned int dir;
+	unsigned int slot;
+};
+
+// a changed subdirectory cluster, held back until the commit has logged it
+typedef struct pending_block{
+	unsigned int index;
+	char* data;
+	pending_block* next;
+};
+
+// an open disk image; the descriptor stays open for the whole session and
+// all cluster I/O is positioned, so nothing ever has to seek or reopen.  In
+// mmap mode the whole image is also mapped, and map is non-NULL
+typedef struct volume{
+	int fd;
+	char* name;
+	char* map;
+	size_t length;
+};
+
+// a cached cluster; entries sit on a doubly-linked LRU list (most recently
+// used at the head) and on a hash chain keyed by cluster index
+typedef struct cache_entry{
+	unsigned int index;
+	bool dirty;
+	char* data;
+	cache_entry* next;
+	cache_entry* prev;
+	cache_entry* hnext;
+};
+
+// write-back cache sitting in front of readCluster()/writeCluster()
+typedef struct cluster_cache{
+	cache_entry** buckets;
+	unsigned int mask;
+	cache_entry* head;
+	cache_entry* tail;
+	unsigned int count;
+	unsigned int capacity;
+	unsigned int cluster_size;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long writebacks;
+};
+
+// tracks which pages of an in-memory table differ from the disk, plus how
+// much writing it has taken to keep them in step
+typedef struct dirtymap{
+	unsigned char* pages;
+	unsigned int count;
+	unsigned long flushes;
+	unsigned long writes;
+	unsigned long bytes;
+};
+
+// the metadata write-ahead journal.  Each command's table changes are 
+// appended as one transaction (a header block listing the pages, then their
+// images) and made durable with a single sync; the tables themselves are
+// only written home at a checkpoint.  A length of zero means no journal
+typedef struct journal{
+	off_t loc;
+	size_t length;
+	size_t head;
+	unsigned int sequence;
+	unsigned long commits;
+	unsigned long bytes;
+	unsigned long checkpoints;
+};
+
+// the first block of a transaction; the page list follows it, with the top
+// two bits of each entry saying which table (or cluster) the page is from
+typedef struct journal_header{
+	unsigned int magic;
+	unsigned int sequence;
+	unsigned int pages;
+	unsigned int checksum;
+};
+
+// tables loaded on demand; each is a private mapping of the image, so its
+// pages are read in on first touch and clean ones can be dropped again to
+// stay under the budget.  Changes never reach the image through the 
+// mapping, only through the usual table writeback
+typedef struct lazy_tables{
+	bool enabled;
+	bool scanned;
+	bool indexed;
+	size_t budget;
+	char* fat_base;
+	size_t fat_span;
+	char* dir_base;
+	size_t dir_span;
+	char* sum_base;
+	size_t sum_span;
+	unsigned long trims;
+	unsigned long dropped;
+};
+
+// the start of a compressed file's data.  The file's blocks follow it, each
+// a pack_block and then its bytes; every block but the last holds a full
+// block of the original file
+typedef struct pack_header{
+	unsigned int magic;
+	unsigned int size; // of the original file
+	unsigned int block;
+};
+
+typedef struct pack_block{
+	unsigned int size; // before packing
+	unsigned int packed; // after, with PACK_STORED if it's a plain copy
+};
+
+// reads a file's data in order through the cluster cache, for data that has
+// to be picked apart rather than just copied out
+typedef struct chain_reader{
+	unsigned int cluster;
+	unsigned int offset; // into the current cluster
+	size_t left; // bytes of the file still to come
+	char* buf; // the current cluster
+	char* data; // an inline file's bytes, which stand in for the chain
+};
+
+// reads a subdirectory's entries in name order, a cluster at a time
+typedef struct dir_reader{
+	unsigned int cluster;
+	unsigned int slot; // of the entry last returned
+	unsigned int blocks; // clusters left, counting the current one
+	char* buf; // the current cluster
+};
+
+// one CRC32C per cluster, in a table after the journal on images made with
+// one.  A zero entry means the cluster hasn't been written since it was 
+// allocated, so there's nothing to check it against yet
+typedef struct cluster_sums{
+	unsigned int* table;
+	bool hardware;
+	unsigned long verified;
+	unsigned long failed;
+};
+
+// a run of freed clusters waiting to have its space given back to the host
+typedef struct hole_run{
+	unsigned int start;
+	unsigned int count;
+	hole_run* next;
+};
+
+// clusters freed by rm (or a shrinking overwrite) are held back from the
+// allocator until the commit that frees them is durable, so a crash can't
+// bring back a file whose clusters were already reused.  With punching on,
+// the commit hands them to a background thread that punches them out of the
+// image, and they only become allocatable again once that's done
+typedef struct reclaimer{
+	bool punch;
+	unsigned int* held; // freed since the last commit
+	unsigned int held_len;
+	unsigned int held_cap;
+	unsigned int waiting; // held clusters, committed or not
+	hole_run* queue; // committed, still to be punched
+	hole_run* done; // punched, still to be handed back
+	unsigned int pending; // runs queued or being punched
+	bool started;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;
+	int fd;
+	unsigned int cluster_size;
+	unsigned long freed;
+	unsigned long punched;
+	unsigned long failed;
+};
+
+// a file the defragmenter looked at; entries don't move while it runs, so
+// a copy of the entry is enough to write it back
+typedef struct frag_file{
+	entry_ref ref;
+	directory entry;
+	unsigned int clusters;
+	unsigned int extents;
+};
+
+// one chain the checker walks: a file's data, or a subdirectory's blocks
+typedef struct fsck_item{
+	entry_ref ref;
+	directory entry;
+	unsigned int expected; // clusters the size (or entry count) calls for
+	unsigned int clusters; // clusters actually in the chain
+	unsigned int last_good; // where a broken or looping chain should end
+	unsigned int problems; // FSCK_* bits
+	unsigned int other; // the item it's cross-linked with
+};
+
+// shared by the checker's threads; items are handed out through next, and
+// owner records which item claimed each cluster first
+typedef struct fsck_job{
+	fsck_item* items;
+	unsigned int count;
+	unsigned int next;
+	unsigned int* owner;
+	unsigned int* file_table;
+	unsigned int first_data;
+	unsigned int threads;
+	int fd;
+	unsigned int cluster_size;
+};
+
+typedef struct fsck_worker{
+	fsck_job* job;
+	unsigned int id;
+	unsigned long leaked;
+	unsigned long corrupt;
+	pthread_t thread;
+};
+
+// one host file for cp -r to bring in; a worker fills in its data, and the
+// entry is only added once every worker is done
+typedef struct import_file{
+	char* host;
+	char* leaf;
+	unsigned int dir; // the directory it goes in; its place in the import's
+	                  // directory list until the directories are made
+	size_t size;
+	unsigned int first; // its chain, or MAX_FILES if it's kept inline
+	bool ok;
+	char data[sizeof(((directory*)NULL)->name)]; // an inline file's contents
+};
+
+// one directory cp -r puts files in; new ones aren't made until the whole 
+// tree has been sized
+typedef struct import_dir{
+	char* path;
+	unsigned int cluster; // its first cluster, or MAX_FILES until it's made
+	unsigned int parent; // its place in the list, MAX_FILES for the top
+	unsigned int added; // entries the import puts in it
+	bool made; // true if the import has to make it
+};
+
+// shared by the import's threads; files are handed out through next, and 
+// the lock is held over the allocator and the FAT, which aren't thread safe
+typedef struct import_job{
+	import_file* files;
+	unsigned int count;
+	unsigned int next;
+	mbr* MBR;
+	unsigned int* file_table;
+	volume* vol;
+	pthread_mutex_t lock;
+};
+
 // globals
 node *history = NULL;
 node *tail = NULL;
 bool donotread = false;
 unsigned int MAX_FILES;
 
+// free-space allocator state; one bit per cluster, set while the cluster is
+// free, so we never have to walk the FAT to find room
+unsigned int* free_map = NULL;
+unsigned int free_count = 0;
+unsigned int free_hint = 0;
+
+// directory index; an open-addressed hash table mapping file names to their
+// slot in the directory table (EMPTY_SLOT marks an unused bucket)
+unsigned int* dir_hash = NULL;
+unsigned int dir_hash_mask = 0;
+
+// how many references (FAT links plus directory entries) point at each
+// cluster; more than one means the cluster is shared copy-on-write
+unsigned int* ref_counts = NULL;
+
+// dirty pages of the FAT and directory table
+dirtymap fat_dirty = {NULL, 0, 0, 0, 0};
+dirtymap dir_dirty = {NULL, 0, 0, 0, 0};
+dirtymap sum_dirty = {NULL, 0, 0, 0, 0};
+
+// the cluster cache; a capacity of zero means every access goes to disk
+cluster_cache cache = {NULL, 0, NULL, NULL, 0, 0, 0, 0, 0, 0, 0};
+
+// the journal; stays empty for volumes made before it existed
+journal wal = {0, 0, 0, 0, 0, 0, 0};
+
+// subdirectory clusters changed since the last commit
+pending_block* pending_blocks = NULL;
+
+// lazy table state; scanned stays true unless a lazy mount put off building
+// the free map, directory index and reference counts, and indexed unless it
+// put off the index
+lazy_tables lazy = {false, true, true, 0, NULL, 0, NULL, 0, NULL, 0, 0, 0};
+
+// cluster checksums, and the lookup tables for working them out without
+// the CPU's help
+cluster_sums sums = {NULL, false, 0, 0};
+unsigned int crc_tables[8][256];
+
+// freed clusters on their way back to the allocator
+reclaimer holes = {false, NULL, 0, 0, 0, NULL, NULL, 0, false, 0, 
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 
+	PTHREAD_COND_INITIALIZER, -1, 0, 0, 0, 0};
+
+// set by ^C while defrag runs; it stops after the file it's moving
+volatile sig_atomic_t defrag_stop = 0;
+
+// a server runs its clients' commands, but never hands anything to the host;
+// ^C or a TERM stops it once the command it's on is done
+bool serving = false;
+volatile sig_atomic_t server_stop = 0;
+
+// while a client's command runs, a timer watches its output; if the client 
+// stops reading for SERVER_STALL seconds the rest goes to server_sink, so 
+// one stuck shell can't hold up the others
+volatile sig_atomic_t stall_ticks = 0;
+int server_sink = -1;
+pthread_t server_thread;
+
+// an attached shell's connection to the server that owns the volume
+int server_fd = -1;
+
+// while a script runs, commands leave their changes in memory and only sync
+// points commit them
+bool batch_mode = false;
+unsigned long batch_commits = 0;
+
 // functions
 void printHistory(node *history);
 void handler_function(int sig_id);
@@ -71,27 +472,246 @@ void resetBuf(char* buf);
 void processTerminated(int childPID);
 void clearInput();
 int checkFSIntegrity(mbr * MBR);
-void updateFileTable(FILE* fp, mbr* MBR, unsigned int* file_table);
-void updateDirectoryTable(FILE* fp, mbr* MBR, directory* dir_table);
+void updateFileTable(volume* vol, mbr* MBR, unsigned int* file_table);
+void updateDirectoryTable(volume* vol, mbr* MBR, directory* dir_table);
+void updateChecksumTable(volume* vol, mbr* MBR);
 bool inVirtualFileSystem(char* file_path, char* fs_name);
-bool createFile(char* name, directory* dir_table, mbr* MBR, FILE* fp, 
+bool createFile(char* name, directory* dir_table, mbr* MBR, volume* vol, 
 	unsigned int* file_table);
-void printDirectoryTree(mbr* MBR, directory* dir_table);
+void printDirectoryTree(mbr* MBR, directory* dir_table, 
+		unsigned int* file_table, volume* vol);
 void deleteFile(directory* files, unsigned int* file_table, int index);
 unsigned int findDirectoryIndexOfFile(directory* files, char* filename);
-void showFileSystemStructure(unsigned int* file_table, mbr* MBR);
+void showFileSystemStructure(mbr* MBR, directory* dir_table, 
+		unsigned int* file_table, volume* vol, bool show_map);
 void copyVirtToVirt(char* src, char* dst, mbr* MBR, directory* files, 
-		unsigned int* file_table, FILE* fp);
-void copyHostToVirt(char* src, char* dst, mbr* MBR, directory* files, 
-		unsigned int* file_table, FILE* fp, char* fsname);
-char* readCluster(mbr* MBR, unsigned int index, unsigned int size, FILE* fp);		
+		unsigned int* file_table, volume* vol);
+void copyVirtToHost(char* src, char* dst, mbr* MBR, directory* files, 
+		unsigned int* file_table, volume* vol);
+unsigned int newDirectoryEntry(mbr* MBR, directory* dir_table, char* name,
+		unsigned int size);
+unsigned int appendHostData(mbr* MBR, unsigned int* file_table, 
+		volume* filesystem, int host_file, size_t size, unsigned int needed,
+		unsigned int tail);
+bool overwriteFile(int host_file, size_t size, directory* entry, mbr* MBR,
+		unsigned int* file_table, volume* filesystem);
+void importTree(char* src, char* dst, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table, volume* vol);
+void collectImports(char* host, unsigned int at, mbr* MBR, 
+		directory* dir_table, unsigned int* file_table, volume* vol, 
+		import_file** list, unsigned int* count, unsigned int* cap, 
+		import_dir** dirs, unsigned int* dir_count, unsigned int* dir_cap);
+bool listImportDirectory(char* path, unsigned int parent, mbr* MBR, 
+		directory* dir_table, unsigned int* file_table, volume* vol, 
+		import_dir** dirs, unsigned int* dir_count, unsigned int* dir_cap);
+void freeImports(import_file* files, unsigned int count, import_dir* dirs,
+		unsigned int dir_count);
+bool importDirectory(char* path, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table, volume* vol, unsigned int* dir);
+void* importFiles(void* arg);
+int compareImports(const void* a, const void* b);
+int packHostFile(int host_file, size_t size, size_t* packed);
+bool unpackFile(mbr* MBR, unsigned int* file_table, volume* vol, 
+		directory* entry, int out_fd, bool preallocate);
+size_t lzCompress(const unsigned char* src, size_t len, unsigned char* dst, 
+		size_t cap, unsigned int* table);
+bool lzEmit(unsigned char* dst, size_t cap, size_t* op, 
+		const unsigned char* lit, size_t lit_len, unsigned int offset, 
+		size_t match);
+bool lzDecompress(const unsigned char* src, size_t len, unsigned char* dst,
+		size_t size);
+void openChain(mbr* MBR, chain_reader* reader, directory* entry);
+bool readChain(mbr* MBR, unsigned int* file_table, volume* vol, 
+		chain_reader* reader, void* dst, size_t len);
+bool isClusterLink(unsigned int value);
+size_t inlineRoom(const char* name);
+bool fitsInline(const char* name, size_t size);
+char* inlineData(directory* entry);
+void setInline(directory* entry, const char* data, size_t size);
+bool spillInline(mbr* MBR, unsigned int* file_table, volume* vol, 
+		directory* entry);
+void buildRefCounts(mbr* MBR, directory* dir_table, unsigned int* file_table,
+		volume* vol);
+unsigned int unshareCluster(mbr* MBR, unsigned int* file_table, 
+		directory* entry, unsigned int prev, unsigned int cur, bool copy, 
+		volume* vol);
+void releaseChain(unsigned int* file_table, unsigned int index);
+void holdCluster(unsigned int index);
+void releaseHold(unsigned int index);
+void commitHolds(volume* vol, mbr* MBR);
+void collectHoles(bool wait);
+void* punchHoles(void* arg);
+int compareClusters(const void* a, const void* b);
+void dropStaleDirectoryBlocks(mbr* MBR, directory* dir_table, 
+		unsigned int* file_table, volume* vol);
+void markDirectoryChain(mbr* MBR, unsigned int* file_table, volume* vol, 
+		unsigned int dir, bool* live);
+void defragVolume(mbr* MBR, directory* dir_table, unsigned int* file_table,
+		volume* vol);
+void collectFiles(mbr* MBR, directory* dir_table, unsigned int* file_table, 
+		volume* vol, unsigned int dir, frag_file** list, unsigned int* count,
+		unsigned int* cap);
+bool measureChain(unsigned int* file_table, unsigned int index, 
+		unsigned int* clusters, unsigned int* extents);
+void printFragmentation(const char* label, frag_file* list, 
+		unsigned int count, unsigned int shared);
+int compareFragments(const void* a, const void* b);
+void stopDefrag(int sig_id);
+void checkVolume(mbr* MBR, directory* dir_table, unsigned int* file_table,
+		volume* vol, bool repair);
+void collectChains(mbr* MBR, directory* dir_table, unsigned int* file_table,
+		volume* vol, unsigned int dir, fsck_item** list, unsigned int* count,
+		unsigned int* cap, bool* seen);
+void* walkChains(void* arg);
+void* findLeaks(void* arg);
+void* verifySums(void* arg);
+void repairChain(mbr* MBR, directory* dir_table, unsigned int* file_table, 
+		volume* vol, fsck_item* items, fsck_item* item);
+void copyHostToVirt(char* src, char* dst, bool compress, mbr* MBR, 
+		directory* files, unsigned int* file_table, volume* vol);
+bool readCluster(mbr* MBR, char* buf, unsigned int index, unsigned int size,
+		volume* vol);
+bool inMapping(volume* vol, unsigned int index, off_t loc, size_t len);
 off_t fsize(const char *filename);
-void writeCluster(mbr* MBR, unsigned int index, char* buf, FILE* fp);
+void writeCluster(mbr* MBR, unsigned int index, char* buf, volume* vol);
+void writeClusters(mbr* MBR, unsigned int index, unsigned int count, 
+		char* buf, volume* vol);
+unsigned int chainRunLength(mbr* MBR, unsigned int* file_table, 
+		unsigned int start, unsigned int max, unsigned int* next);
+bool sendClusters(mbr* MBR, volume* vol, int out_fd, unsigned int index, 
+		size_t bytes);
+bool readClusters(mbr* MBR, char* buf, unsigned int index, size_t bytes,
+		volume* vol);
+bool copyClusters(mbr* MBR, volume* vol, unsigned int src, unsigned int dst,
+		unsigned int count);
+bool writeFully(int fd, char* buf, size_t len);
+size_t readFully(int fd, char* buf, size_t len);
+volume* openVolume(char* fsname, bool use_mmap);
+volume* createVolume(char* fsname, mbr* MBR, bool use_mmap);
+volume* attachVolume(int fd, char* fsname, bool use_mmap);
+void loadTables(volume* vol, mbr* MBR, directory** dir_table, 
+		unsigned int** file_table, bool blank);
+void syncVolume(volume* vol);
+char* mapTable(volume* vol, off_t loc, size_t len, char** base, 
+		size_t* span);
+void ensureTables(mbr* MBR, directory* dir_table, unsigned int* file_table,
+		volume* vol);
+void ensureIndex(mbr* MBR, directory* dir_table);
+void trimTables(mbr* MBR);
+void trimMapping(char* base, size_t span, size_t slack, size_t table_len,
+		dirtymap* dirty);
+void closeVolume(volume* vol);
+void initClusterCache(unsigned int budget, unsigned int cluster_size);
+cache_entry* findCachedCluster(unsigned int index);
+cache_entry* cacheCluster(volume* vol, unsigned int index, bool load);
+void touchCacheEntry(cache_entry* entry);
+void invalidateCachedCluster(unsigned int index);
+void unlinkCacheEntry(cache_entry* entry);
+int compareCacheEntries(const void* a, const void* b);
+void flushClusterCache(volume* vol);
 unsigned int findFreeCluster(mbr * MBR, unsigned int * file_table);
+unsigned int allocateRun(mbr* MBR, unsigned int* file_table, 
+		unsigned int want, unsigned int* start);
 unsigned int findTotalFreeClusterCount();
+unsigned int firstDataCluster(mbr* MBR);
+bool isFormatV2(mbr* MBR);
+unsigned int clusterCount(mbr* MBR);
+off_t diskSize(mbr* MBR);
+void setFormat(mbr* MBR);
+void buildFreeMap(mbr* MBR, unsigned int* file_table);
+void setFileTableEntry(unsigned int* file_table, unsigned int index, 
+		unsigned int value);
+unsigned int hashFileName(const char* name);
+void buildDirectoryIndex(mbr* MBR, directory* dir_table);
+void indexDirectoryEntry(directory* dir_table, unsigned int index);
+void unindexDirectoryEntry(directory* dir_table, unsigned int index);
+void initDirtyMap(dirtymap* dirty, size_t table_len);
+void markDirty(dirtymap* dirty, size_t offset, size_t length);
+void markDirectoryEntryDirty(unsigned int index);
+void flushDirtyPages(volume* vol, dirtymap* dirty, char* table, 
+		size_t table_len, off_t loc);
+void printVolumeStats(mbr* MBR);
+void commitTables(volume* vol, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table);
+void commitCommand(volume* vol, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table);
+void runCommand(char* buf, char* fsname, mbr* MBR, directory* files, 
+		unsigned int* file_table, volume* filesystem);
+void runBatch(FILE* script, char* fsname, mbr* MBR, directory* files, 
+		unsigned int* file_table, volume* filesystem);
+bool isVolumeCommand(char* line, char* fsname);
+void serveVolume(char* path, char* fsname, mbr* MBR, directory* files, 
+		unsigned int* file_table, volume* filesystem);
+bool serveRequest(int client, int home, char* fsname, mbr* MBR, 
+		directory* files, unsigned int* file_table, volume* filesystem);
+void stopServer(int sig_id);
+void watchOutput(int sig_id);
+int connectServer(char* path, char* fsname, size_t len);
+bool forwardCommand(char* line);
+bool lockVolume(volume* vol, char* fsname);
+void openJournal(volume* vol, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table);
+bool logDirtyPages(volume* vol, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table);
+void checkpointJournal(volume* vol, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table);
+void drainJournal(volume* vol, mbr* MBR);
+unsigned int checksumBytes(const char* buf, size_t len);
+void initChecksums();
+unsigned int crc32c(const char* buf, size_t len);
+unsigned int crc32cSoftware(unsigned int crc, const char* buf, size_t len);
+#if defined(__x86_64__)
+unsigned int crc32cHardware(unsigned int crc, const char* buf, size_t len);
+#endif
+void recordChecksums(const char* buf, unsigned int index, unsigned int count,
+		unsigned int cluster_size);
+unsigned int verifyClusters(const char* buf, unsigned int index, 
+		unsigned int count, unsigned int cluster_size);
+bool hasChecksums(mbr* MBR);
+void readDirectoryBlock(mbr* MBR, unsigned int index, char* buf, 
+		volume* vol);
+void writeDirectoryBlock(mbr* MBR, unsigned int index, char* buf);
+void forgetDirectoryBlock(unsigned int index);
+void flushDirectoryBlocks(mbr* MBR, volume* vol);
+unsigned int directoryBlock(unsigned int* file_table, unsigned int dir, 
+		unsigned int block);
+unsigned int newDirectoryBlocks(mbr* MBR, unsigned int* file_table);
+unsigned int directoryBlocks(mbr* MBR, char* buf);
+unsigned int blockEnd(directory* slots, unsigned int first, 
+		unsigned int per_block);
+void openDirectory(mbr* MBR, volume* vol, dir_reader* reader, 
+		unsigned int dir);
+directory* nextDirectoryEntry(mbr* MBR, unsigned int* file_table, 
+		volume* vol, dir_reader* reader);
+bool searchDirectory(mbr* MBR, unsigned int* file_table, volume* vol, 
+		unsigned int dir, char* name, unsigned int* slot, directory* entry);
+bool findEntry(mbr* MBR, directory* dir_table, unsigned int* file_table, 
+		volume* vol, char* path, entry_ref* ref, directory* entry);
+bool findParent(mbr* MBR, directory* dir_table, unsigned int* file_table, 
+		volume* vol, char* path, unsigned int* dir, char** leaf);
+bool addEntry(mbr* MBR, directory* dir_table, unsigned int* file_table, 
+		volume* vol, unsigned int dir, char* name, directory* entry);
+void storeEntry(mbr* MBR, directory* dir_table, unsigned int* file_table, 
+		volume* vol, entry_ref ref, directory* entry);
+void removeEntry(mbr* MBR, directory* dir_table, unsigned int* file_table, 
+		volume* vol, entry_ref ref);
+unsigned int directoryCount(mbr* MBR, unsigned int* file_table, volume* vol,
+		unsigned int dir);
+void setDirectoryBlocks(mbr* MBR, volume* vol, unsigned int dir, 
+		unsigned int blocks);
+void makeDirectory(char* path, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table, volume* vol);
+unsigned int addDirectory(char* path, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table, volume* vol);
+void listDirectory(mbr* MBR, unsigned int* file_table, volume* vol, 
+		unsigned int dir);
+void printDirectoryEntry(mbr* MBR, unsigned int* file_table, volume* vol, 
+		directory* entry);
+void countDirectoryRefs(mbr* MBR, unsigned int* file_table, volume* vol, 
+		unsigned int dir);
 unsigned int findFreeDirEntry(mbr* MBR, directory* dir_table);
 void printFile(mbr * MBR, unsigned int * file_table, directory * dir_table,
-		char* filename, FILE* filesystem);
+		char* filename, volume* filesystem);
 
 /*
 * The mother of all main functions
@@ -100,28 +720,92 @@ int main(int argc, char *argv[]){
 
 	// vars
 	char buf[MAX_BUF_SIZE-1];
-	char* tokens;
 	bool alive;
-	mbr* MBR;
+	mbr* MBR = 0;
 	unsigned int curHistSize = 0;
-	char fsname[strlen(argv[1])+1];
-	memcpy(&fsname, argv[1], strlen(argv[1])+1);	
-	FILE * filesystem;
+	bool use_mmap = false;
+	unsigned int cache_kb = DEFAULT_CACHE;
+	int opt;
+	FILE* script = NULL;
+	char* serve = NULL;
+	char* attach = NULL;
+	volume* filesystem = NULL;
 	directory* files;
 	unsigned int* file_table;
 	
+	// -m maps the whole image into memory instead of reading/writing it,
+	// -c sets the cluster cache budget in KB (0 turns the cache off),
+	// -b runs the commands in a script (- for stdin) instead of prompting,
+	// -l loads the tables on demand, keeping about budget_kb of them around,
+	// -p gives freed clusters' space back to the host by punching holes,
+	// -s serves the volume to other shells over a socket,
+	// -a attaches to a server instead of opening an image
+	while((opt = getopt(argc, argv, "mc:b:l:ps:a:")) != -1){
+		if(opt == 'm')
+			use_mmap = true;
+		else if(opt == 'p')
+			holes.punch = true;
+		else if(opt == 'c')
+			cache_kb = atoi(optarg);
+		else if(opt == 's')
+			serve = optarg;
+		else if(opt == 'a')
+			attach = optarg;
+		else if(opt == 'l'){
+			lazy.enabled = true;
+			lazy.budget = (size_t)atoi(optarg) * KILOBYTE;
+		}
+		else if(opt == 'b'){
+			script = strcmp(optarg, "-") == 0 ? stdin : fopen(optarg, "r");
+			if(script == NULL){
+				cerr << "Couldn't open " << optarg << "!\n";
+				exit(1);
+			}
+		}
+		else
+			optind = argc;
+	}
+	if((attach != NULL ? optind != argc : optind != argc - 1) 
+			|| (attach != NULL && (serve != NULL || script != NULL))
+			|| (serve != NULL && script != NULL)){
+		cerr << "Usage: " << argv[0] << " [-m] [-c cache_kb] [-b script] "
+				"[-l budget_kb] [-p] [-s socket] filesystem\n"
+				"       " << argv[0] << " -a socket\n";
+		exit(1);
+	}
+	char fsname[attach != NULL ? PATH_MAX : strlen(argv[optind])+1];
+	
+	// an attached shell gets the filesystem's name from its server, and
+	// leaves the image alone
+	if(attach != NULL){
+		server_fd = connectServer(attach, fsname, sizeof(fsname));
+		if(server_fd < 0){
+			cerr << "Couldn't reach a server on " << attach << "!\n";
+			exit(1);
+		}
+	}
+	else
+		memcpy(&fsname, argv[optind], strlen(argv[optind])+1);	
+	
 	// make sure we got a clean slate after creating the buffer
 	resetBuf(buf);
 	
-	// check if the filesystem already exists
-	filesystem = fopen(fsname, "r");
-	if(!filesystem){
-		
-		// don't leave the filepointer open
-		fclose(filesystem);
+	// check if the filesystem already exists; whoever opens it has it to 
+	// themselves, and other shells share it through a server
+	if(attach == NULL)
+		filesystem = openVolume(fsname, use_mmap);
+	if(filesystem && !lockVolume(filesystem, fsname))
+		exit(1);
+	if(!filesystem && script != NULL){
+		cerr << "There's no filesystem at " << fsname << " to run a script "
+				"against!\n";
+		exit(1);
+	}
+	if(!filesystem && attach == NULL){
 		
 		// vars
 		int fs_size, fs_csize;
+		off_t fs_bytes;
 		
 		// the FS does not exist, let's make sure the user actually wants to
 		// create one
@@ -142,11 +826,11 @@ int main(int argc, char *argv[]){
 			fs_size = r == 1 ? DEFAULT_SIZE : atoi(buf);
 			
 			// keep re-asking until a valid value is given
-			while(r != 1 && (fs_size > 50 || fs_size < 5)){
+			while(r != 1 && (fs_size > (int)MAX_SIZE || fs_size < 5)){
 				
 				// the user can't do that...
 				cerr << "That is not a valid filesize.  Valid integer"
-					 " values are 5..50\n";
+					 " values are 5.." << MAX_SIZE << "\n";
 				
 				// re-ask the user for the filesystem size
 				printf("Enter the maximum size for this file system in MB "
@@ -157,7 +841,7 @@ int main(int argc, char *argv[]){
 				fs_size = r == 1 ? DEFAULT_SIZE : atoi(buf);
 			}
 			
-			fs_size = fs_size * MEGABYTE;
+			fs_bytes = (off_t)fs_size * MEGABYTE;
 			
 			// prompt user for the cluster size
 			printf("Enter the cluster size for this file system in KB [8]: ");
@@ -185,71 +869,77 @@ int main(int argc, char *argv[]){
 			fs_csize = fs_csize * KILOBYTE;
 			
 			// now that we have a max filesystem size and a cluster size, we
-			// can compute the maximum number of files that can be recorded
-			MAX_FILES = (fs_size)/(fs_csize);
-			
-			// lets also determine if we can actually store all those records
-			// in our File Allocation Table
-			if(fs_csize < MAX_FILES*4){
-				cerr << "Whoops! Looks like you need to make the cluster"
-						" size a little larger or reduce the maximum size of"
-						" your filesystem!  The FAT can't fit!\n";
-				exit(1); // for now just exit--later repromt user for data
-			}
+			// can compute the maximum number of files that can be recorded;
+			// the FAT simply spans as many clusters as it needs
+			MAX_FILES = fs_bytes / fs_csize;
 			
-			// create the struct to store our filesystem data
+			// create the struct to store our filesystem data; new 
+			// filesystems always use the v2 format, which keeps its size in
+			// clusters so it can go past 4GB
 			MBR = (mbr*)malloc(sizeof(mbr));
 			MBR->cluster_size = fs_csize;
-			MBR->disk_size = fs_size;
+			MBR->disk_size = fs_bytes > UINT_MAX ? UINT_MAX : fs_bytes;
+			MBR->version = FORMAT_V2;
+			MBR->cluster_count = MAX_FILES;
 			MBR->dir_table_index = 1;
-			MBR->FAT_index = 2;
 			
-			// actually create the filesystem on the disk by "jumping" to the
-			// location of the file that will be the size of our filesystem
-			// and closing off the file with a NUL-byte
-			filesystem = fopen(fsname, "w");
-			fseek(filesystem, fs_size-1, SEEK_SET);
-			char zero[] = {'\0'};
-			fwrite(&zero, 1, 1, filesystem);
-			fclose(filesystem);
+			// the directory table spans several clusters, so the FAT has to 
+			// start after the last of them
+			MBR->FAT_index = MBR->dir_table_index + (MAX_FILES * 
+				sizeof(directory) + fs_csize - 1) / fs_csize;
 			
-			// write the MBR to the filesystem
-			filesystem = fopen(fsname, "r+");
-			fseek(filesystem, 0, SEEK_SET);
-			fwrite(MBR, sizeof(int), sizeof(MBR), filesystem);
-			fclose(filesystem);
-			filesystem = fopen(fsname, "r+");
+			// and the journal goes after the FAT
+			MBR->magic = JOURNAL_MAGIC;
+			MBR->journal_index = MBR->FAT_index + (MAX_FILES * 
+				sizeof(unsigned int) + fs_csize - 1) / fs_csize;
+			MBR->journal_clusters = (JOURNAL_KB * KILOBYTE + fs_csize - 1) 
+				/ fs_csize;
+			MBR->journal_sequence = 1;
+			
+			// with the cluster checksums after that; the table starts out
+			// as a hole too, and all zeroes means nothing's been written
+			MBR->checksum_index = MBR->journal_index 
+				+ MBR->journal_clusters;
+			setFormat(MBR);
+			
+			// actually create the filesystem on the disk; the image starts
+			// out as one big hole, and only the MBR gets written
+			filesystem = createVolume(fsname, MBR, use_mmap);
+			if(!filesystem){
+				cerr << "Couldn't create " << fsname << "!\n";
+				exit(1);
+			}
+			if(!lockVolume(filesystem, fsname))
+				exit(1);
 			
 			// alright, now that we got all that setup, lets create our 
-			// directory table array and file allocation array
-			files = (directory*)(malloc(sizeof(directory)*MAX_FILES));
-			file_table = (unsigned int*)(malloc(sizeof(unsigned int)
-				*MAX_FILES));
-				
-			// mark the whole directory table as "available" (which will also
-			// conveniently set the size, type, and creation to default values;
-			// the value of index is worthless for "available" entries)
-			memset(files, sizeof(files), FREE_CLUSTER);
+			// directory table array and file allocation array; the new
+			// image is all zeroes, so every directory entry and cluster is
+			// already marked "available" (the value of index is worthless
+			// for "available" entries) and there's nothing to read
+			loadTables(filesystem, MBR, &files, &file_table, true);
+			if(filesystem->map == NULL)
+				initClusterCache(cache_kb * KILOBYTE, MBR->cluster_size);
 			
 			// write our directory table to the disk
 			updateDirectoryTable(filesystem, MBR, files);
-				
-			// set all files to "available"
-			memset(file_table, sizeof(file_table), FREE_CLUSTER);
+			buildDirectoryIndex(MBR, files);
 			
-			// mark the first 3 clusters as reserved and write to our disk
-			file_table[0] = RESERVE_CLUSTER;
-			file_table[1] = RESERVE_CLUSTER;
-			file_table[2] = RESERVE_CLUSTER;
+			// the free map reserves the MBR, both tables and the journal,
+			// everything else is up for grabs; only the FAT pages holding
+			// those reservations need writing
+			buildFreeMap(MBR, file_table);
+			buildRefCounts(MBR, files, file_table, filesystem);
 			updateFileTable(filesystem, MBR, file_table);
+			openJournal(filesystem, MBR, files, file_table);
+			syncVolume(filesystem);
 		}
 	}
-	else{
+	else if(filesystem){
 		
 		// since the filesystem already exists, load its MBR into memory
-		filesystem = fopen(fsname, "r+");
 		MBR = (mbr*)malloc(sizeof(mbr));
-		fread(MBR, sizeof(int), sizeof(MBR), filesystem);
+		pread(filesystem->fd, MBR, sizeof(mbr), 0);
 		
 		// do some basic checking to make sure the MBR isn't corrupt or
 		// worthless		
@@ -267,7 +957,7 @@ int main(int argc, char *argv[]){
 				MBR = 0;
 				
 				// clear the filesystem name
-				memset(fsname, sizeof(fsname), '\0');
+				memset(fsname, '\0', sizeof(fsname));
 				
 				// let the user know that the filesystem has been discarded
 				cerr << "Filesystem not loaded!\n";
@@ -282,24 +972,27 @@ int main(int argc, char *argv[]){
 		// if we got a non-null MBR, then everything is good to go!
 		if(MBR != 0){
 			
-			// compute the max number of files
-			MAX_FILES = (MBR->disk_size)/(MBR->cluster_size);
+			// compute the max number of files, and pick the FAT markers 
+			// this format uses
+			MAX_FILES = clusterCount(MBR);
+			setFormat(MBR);
 			
-			// alright, use the MBR to figure out where the directory table
-			// and file allocation table are located
-			unsigned int dir_loc = MBR->dir_table_index * MBR->cluster_size;
-			unsigned int fat_loc = MBR->FAT_index * MBR->cluster_size;
-				
-			// create space enough for the tables
-			files = (directory*)(calloc(MAX_FILES, sizeof(directory)));
-			file_table = (unsigned int*)(calloc(MAX_FILES, 
-				sizeof(unsigned int)));
+			// locate the tables and bring them in; a mapped image needs no
+			// cache of its own
+			loadTables(filesystem, MBR, &files, &file_table, false);
+			if(filesystem->map == NULL)
+				initClusterCache(cache_kb * KILOBYTE, MBR->cluster_size);
+			
+			// finish off anything the last session committed but never 
+			// wrote home
+			openJournal(filesystem, MBR, files, file_table);
 			
-			// locate and read the tables in
-			fseek(filesystem, dir_loc, SEEK_SET);
-			fread(files, sizeof(directory), MAX_FILES, filesystem);
-			fseek(filesystem, fat_loc, SEEK_SET);
-			fread(file_table, sizeof(unsigned int), MAX_FILES, filesystem);
+			// figure out which clusters are still available, and where all
+			// of our files are; a lazy mount waits until a command needs 
+			// to know
+			lazy.scanned = lazy.indexed = false;
+			if(!lazy.enabled || lazy.dir_base == NULL)
+				ensureTables(MBR, files, file_table, filesystem);
 		}
 	}
 
@@ -317,7 +1010,9 @@ int main(int argc, char *argv[]){
 	sigaction(SIGILL, &signal_action, NULL);
 	sigaction(SIGTRAP, &signal_action, NULL);
 	sigaction(SIGABRT, &signal_action, NULL);
+#ifdef SIGEMT
 	sigaction(SIGEMT, &signal_action, NULL);
+#endif
 	sigaction(SIGFPE, &signal_action, NULL);
 	sigaction(SIGKILL, &signal_action, NULL);
 	sigaction(SIGBUS, &signal_action, NULL);
@@ -328,7 +1023,6 @@ int main(int argc, char *argv[]){
 	sigaction(SIGTERM, &signal_action, NULL);
 	sigaction(SIGUSR1, &signal_action, NULL);
 	sigaction(SIGUSR2, &signal_action, NULL);
-	sigaction(SIGCHLD, &signal_action, NULL);
 	sigaction(SIGPWR, &signal_action, NULL);
 	sigaction(SIGWINCH, &signal_action, NULL);
 	sigaction(SIGURG, &signal_action, NULL);
@@ -342,7 +1036,32 @@ int main(int argc, char *argv[]){
 	sigaction(SIGPROF, &signal_action, NULL);
 	sigaction(SIGXCPU, &signal_action, NULL);
 	sigaction(SIGXFSZ, &signal_action, NULL);
+#ifdef SIGWAITING
 	sigaction(SIGWAITING, &signal_action, NULL);
+#endif
+	
+	// an attached shell's host commands finishing isn't worth a message
+	if(attach == NULL)
+		sigaction(SIGCHLD, &signal_action, NULL);
+	
+	// a server takes its commands from its clients until it's stopped
+	if(serve != NULL){
+		if(MBR == 0)
+			exit(1);
+		serveVolume(serve, fsname, MBR, files, file_table, filesystem);
+		checkpointJournal(filesystem, MBR, files, file_table);
+		closeVolume(filesystem);
+		exit(EXIT_SUCCESS);
+	}
+	
+	// a script runs start to finish without any prompting
+	if(script != NULL){
+		if(MBR == 0)
+			exit(1);
+		runBatch(script, fsname, MBR, files, file_table, filesystem);
+		closeVolume(filesystem);
+		exit(EXIT_SUCCESS);
+	}
 	
 	// initialization setup
 	alive = true;
@@ -359,6 +1078,9 @@ int main(int argc, char *argv[]){
 		// if nothing was read, assume ^D was sent
 		if(r == 0){
 			cout << endl;
+			if(MBR != 0)
+				checkpointJournal(filesystem, MBR, files, file_table);
+			closeVolume(filesystem);
 			exit(EXIT_SUCCESS);
 		}
 		
@@ -442,201 +1164,359 @@ int main(int argc, char *argv[]){
 			}
 		}
 		
-		// tokenize the string
-		char *tokenArgs[r];
-		memset(tokenArgs, 0, r);
-		tokens = strtok(buf, " \n");
-		int i = 0;
-		bool runInBG = false;
-		
-		// read all tokens		
-		while(tokens != NULL){
-			// strncpy(tokenArgs[i], tokens, strlen(tokens)+1);
-			
-			tokenArgs[i] = tokens;
-			
-			// if a token contains the &, then we need to run the command
-			// in the background
-			if(tokens != NULL && strcmp(tokens, "&") == 0){
-				runInBG = true;
+		// an attached shell hands the volume's commands to its server
+		if(server_fd >= 0 && isVolumeCommand(buf, fsname)){
+			if(!forwardCommand(buf)){
+				cerr << "Whoops! Lost the server!\n";
+				exit(1);
 			}
-			
-			i++;
-			tokens = strtok(NULL, " \n");
 		}
+		else
+			runCommand(buf, fsname, MBR, files, file_table, filesystem);
+		
+		// make sure nothing is sitting in the buffer
+		fflush(stdout);
 		
-		// if we read an argument, pad the end of the array with a nul-byte
-		if(i > 1)
-			tokenArgs[i] = (char*)0;
+		// clear the input buffer for the next read
+		resetBuf(buf);
+	}
+}
+
+/*
+* Runs a single command line; the shell's own commands are handled here,
+* anything else gets forked off to the host.
+*
+* @param	buf				the trimmed command line; it gets tokenized in 
+*							place
+* @param	fsname			name of the loaded filesystem
+*/
+void runCommand(char* buf, char* fsname, mbr* MBR, directory* files, 
+		unsigned int* file_table, volume* filesystem){
+	
+	// vars
+	char* tokens;
+	
+	// tokenize the string
+	int r = strlen(buf) + 1;
+	char *tokenArgs[r];
+	memset(tokenArgs, 0, r);
+	tokens = strtok(buf, " \n");
+	int i = 0;
+	bool runInBG = false;
+	
+	// read all tokens		
+	while(tokens != NULL){
+		// strncpy(tokenArgs[i], tokens, strlen(tokens)+1);
 		
-		// determine where this command is going
-		bool argOneInVirt = false;
-		if(i > 1)
-			argOneInVirt = inVirtualFileSystem(tokenArgs[1], fsname);
-		bool argTwoInVirt = false;
-		if(i > 2)
-			argTwoInVirt = inVirtualFileSystem(tokenArgs[2], fsname);
+		tokenArgs[i] = tokens;
 		
-		// check if we are running a shell-specific command
-		if(strncmp(buf, "history", sizeof(buf)) == 0){
-			printHistory(history);
-			continue;
+		// if a token contains the &, then we need to run the command
+		// in the background
+		if(tokens != NULL && strcmp(tokens, "&") == 0){
+			runInBG = true;
 		}
-		else if(strncmp(buf, "touch", sizeof(buf)) == 0){
-			if(argOneInVirt){
-				
-				// break out the filename
-				char* filename = strchr(tokenArgs[1]+1, '/')+1;
-				
-				// make sure we weren't passed nothing
-				if(strlen(filename) == 0){
-					fprintf(stderr, "What!? No filename?!\n");
-					continue;
-				}
-				
-				// update all the tables
-				createFile(filename, files, MBR, filesystem, file_table);
-	
-				// write the tables to the disks
-				updateFileTable(filesystem, MBR, file_table);
-				filesystem = fopen(fsname, "r+");
-				updateDirectoryTable(filesystem, MBR, files);
-				filesystem = fopen(fsname, "r+");
-				
-				// skip everything else
-				continue;
-			}
-			
-			// if we reached here, then this touch command is a normal one
+		
+		i++;
+		tokens = strtok(NULL, " \n");
+	}
+	
+	// if we read an argument, pad the end of the array with a nul-byte
+	if(i > 1)
+		tokenArgs[i] = (char*)0;
+	
+	// determine where this command is going
+	bool argOneInVirt = false;
+	if(i > 1)
+		argOneInVirt = inVirtualFileSystem(tokenArgs[1], fsname);
+	bool argTwoInVirt = false;
+	if(i > 2)
+		argTwoInVirt = inVirtualFileSystem(tokenArgs[2], fsname);
+	// commands that only read the volume just have to find their files
+	bool readOnly = strcmp(buf, "ls") == 0 || strcmp(buf, "cat") == 0
+		|| (strcmp(buf, "cp") == 0 && argOneInVirt && !argTwoInVirt);
+	if((argOneInVirt || argTwoInVirt) && MBR != 0){
+		if(readOnly)
+			ensureIndex(MBR, files);
+		else
+			ensureTables(MBR, files, file_table, filesystem);
+	}
+	collectHoles(false);
+	
+	// check if we are running a shell-specific command
+	if(strncmp(buf, "history", MAX_BUF_SIZE) == 0){
+		printHistory(history);
+		return;
+	}
+	else if(strncmp(buf, "stats", MAX_BUF_SIZE) == 0){
+		printVolumeStats(MBR);
+		return;
+	}
+	else if(strncmp(buf, "sync", MAX_BUF_SIZE) == 0){
+		if(MBR == 0){
+			fprintf(stderr, "Sorry, there's no volume mounted to sync!\n");
+			return;
 		}
-		else if(strncmp(buf, "ls", sizeof(buf)) == 0){
-			if(argOneInVirt){
-				printDirectoryTree(MBR, files);
-				continue;
+		commitTables(filesystem, MBR, files, file_table);
+		batch_commits++;
+		return;
+	}
+	else if(strncmp(buf, "touch", MAX_BUF_SIZE) == 0){
+		if(argOneInVirt){
+			
+			// break out the filename
+			char* filename = strchr(tokenArgs[1]+1, '/')+1;
+			
+			// make sure we weren't passed nothing
+			if(strlen(filename) == 0){
+				fprintf(stderr, "What!? No filename?!\n");
+				return;
 			}
+			
+			// update all the tables
+			createFile(filename, files, MBR, filesystem, file_table);
+
+			// write the tables to the disks
+			commitCommand(filesystem, MBR, files, file_table);
+			
+			// skip everything else
+			return;
 		}
-		else if(strncmp(buf, "rm", sizeof(buf)) == 0){
-			if(argOneInVirt){
-				
-				// break out the filename
-				char* filename = strchr(tokenArgs[1]+1, '/')+1;
-				
-				// make sure we weren't passed nothing
-				if(strlen(filename) == 0){
-					fprintf(stderr, "What!? No filename?!\n");
-					continue;
-				}
-				
-				// locate the file
-				int index = findDirectoryIndexOfFile(files, filename);
-				
-				// we couldn't find the file
-				if(index == 0){
-					fprintf(stderr, "Sorry, that file doesn't seem to exist!\n");
-					continue;
-				}
-				
-				// remove it
-				deleteFile(files, file_table, index);
-				
-				// write the tables to the disks
-				updateFileTable(filesystem, MBR, file_table);
-				filesystem = fopen(fsname, "r+");
-				updateDirectoryTable(filesystem, MBR, files);
-				filesystem = fopen(fsname, "r+");
-				continue;
+		
+		// if we reached here, then this touch command is a normal one
+	}
+	else if(strncmp(buf, "mkdir", MAX_BUF_SIZE) == 0){
+		if(argOneInVirt){
+			
+			// break out the directory name
+			char* dirname = strchr(tokenArgs[1]+1, '/')+1;
+			
+			// make sure we weren't passed nothing
+			if(strlen(dirname) == 0){
+				fprintf(stderr, "What!? No filename?!\n");
+				return;
 			}
+			
+			makeDirectory(dirname, MBR, files, file_table, filesystem);
+			return;
 		}
-		else if(strncmp(buf, "df", sizeof(buf)) == 0){
-			if(argOneInVirt){
-				showFileSystemStructure(file_table, MBR);
-				continue;
-			}
+	}
+	else if(strncmp(buf, "ls", MAX_BUF_SIZE) == 0){
+		if(argOneInVirt){
+			
+			// the root gets the whole table, anything else its own blocks
+			char* dirname = strchr(tokenArgs[1]+1, '/')+1;
+			entry_ref ref;
+			directory entry;
+			if(!findEntry(MBR, files, file_table, filesystem, dirname, &ref, 
+					&entry) || (entry.type & TYPE_MASK) != TYPE_DIRECTORY)
+				fprintf(stderr, 
+					"Sorry, that directory doesn't seem to exist!\n");
+			else if(entry.index == MAX_FILES)
+				printDirectoryTree(MBR, files, file_table, filesystem);
+			else
+				listDirectory(MBR, file_table, filesystem, entry.index);
+			return;
 		}
-		else if(strncmp(buf, "cp", sizeof(buf)) == 0){		
-			if(argOneInVirt && argTwoInVirt){
-				copyVirtToVirt(tokenArgs[1], tokenArgs[2], MBR, files, file_table, 
-						filesystem);
-				continue;
+	}
+	else if(strncmp(buf, "rm", MAX_BUF_SIZE) == 0){
+		if(argOneInVirt){
+			
+			// break out the filename
+			char* filename = strchr(tokenArgs[1]+1, '/')+1;
+			
+			// make sure we weren't passed nothing
+			if(strlen(filename) == 0){
+				fprintf(stderr, "What!? No filename?!\n");
+				return;
 			}
-			else if(argOneInVirt && !argTwoInVirt){
-				// copyVirtToHost(args[1], args[2], MBR, files, file_table);
-				continue;
+			
+			// locate the file
+			entry_ref ref;
+			directory entry;
+			
+			// we couldn't find the file
+			if(!findEntry(MBR, files, file_table, filesystem, filename, &ref, 
+					&entry) || ref.slot == MAX_FILES){
+				fprintf(stderr, "Sorry, that file doesn't seem to exist!\n");
+				return;
 			}
-			else if(!argOneInVirt && argTwoInVirt){	
-
-				// break out the filename
-				char* filename = strchr(tokenArgs[2]+1, '/')+1;
-				
-				// make sure we weren't passed nothing
-				if(strlen(filename) == 0){
-					fprintf(stderr, "What!? No filename?!\n");
-					continue;
-				}
 			
-				copyHostToVirt(tokenArgs[1], filename, MBR, files, file_table,
-						filesystem, fsname);
-				continue;
+			// directories have to be emptied first
+			if((entry.type & TYPE_MASK) == TYPE_DIRECTORY 
+					&& directoryCount(MBR, file_table, filesystem, 
+					entry.index) != 0){
+				fprintf(stderr, "Sorry, %s isn't empty!\n", filename);
+				return;
 			}
 			
-			// otherwise assumet the command is from the host -> host
+			// remove it
+			removeEntry(MBR, files, file_table, filesystem, ref);
+			
+			// write the tables to the disks
+			commitCommand(filesystem, MBR, files, file_table);
+			return;
 		}
-		else if(strncmp(buf, "cat", sizeof(buf)) == 0){
-			if(argOneInVirt){
-				
-				// break out the filename
-				char* filename = strchr(tokenArgs[1]+1, '/')+1;
-				
-				// make sure we weren't passed nothing
-				if(strlen(filename) == 0){
-					fprintf(stderr, "What!? No filename?!\n");
-					continue;
-				}
-				
-				printFile(MBR, file_table, files, filename, filesystem);
-				
-				continue;
-			}
+	}
+	else if(strncmp(buf, "defrag", MAX_BUF_SIZE) == 0){
+		if(argOneInVirt){
+			defragVolume(MBR, files, file_table, filesystem);
+			return;
 		}
+	}
+	else if(strncmp(buf, "fsck", MAX_BUF_SIZE) == 0){
 		
-		// Run the command
-		pid_t childPID;
-		int childStatus;
+		// -r repairs whatever it can as well
+		if(i > 2 && strcmp(tokenArgs[1], "-r") == 0 && argTwoInVirt){
+			checkVolume(MBR, files, file_table, filesystem, true);
+			return;
+		}
+		if(argOneInVirt){
+			checkVolume(MBR, files, file_table, filesystem, false);
+			return;
+		}
+	}
+	else if(strncmp(buf, "df", MAX_BUF_SIZE) == 0){
 		
-		// create a new process
-		childPID = fork();
+		// -m adds a map of the volume, a line per run of clusters
+		if(i > 2 && strcmp(tokenArgs[1], "-m") == 0 && argTwoInVirt){
+			showFileSystemStructure(MBR, files, file_table, filesystem, true);
+			return;
+		}
+		if(argOneInVirt){
+			showFileSystemStructure(MBR, files, file_table, filesystem, 
+				false);
+			return;
+		}
+	}
+	else if(strncmp(buf, "cp", MAX_BUF_SIZE) == 0){		
 		
-		cerr << tokenArgs[1] << " " << tokenArgs[2] << endl;
+		// -r brings a whole host directory tree in at once
+		if(i > 3 && strcmp(tokenArgs[1], "-r") == 0 
+				&& inVirtualFileSystem(tokenArgs[3], fsname)){
+			ensureTables(MBR, files, file_table, filesystem);
+			importTree(tokenArgs[2], strchr(tokenArgs[3]+1, '/')+1, MBR, 
+				files, file_table, filesystem);
+			return;
+		}
 		
-		// If zero, then this is the child running
-		if(childPID == 0){
+		// -z compresses a file on its way into the volume
+		if(i > 3 && strcmp(tokenArgs[1], "-z") == 0 
+				&& inVirtualFileSystem(tokenArgs[3], fsname)){
+			char* filename = strchr(tokenArgs[3]+1, '/')+1;
+			if(strlen(filename) == 0){
+				fprintf(stderr, "What!? No filename?!\n");
+				return;
+			}
+			ensureTables(MBR, files, file_table, filesystem);
+			copyHostToVirt(tokenArgs[2], filename, true, MBR, files, 
+					file_table, filesystem);
+			return;
+		}
+		if(argOneInVirt && argTwoInVirt){
+			
+			// break out the filenames
+			char* srcname = strchr(tokenArgs[1]+1, '/')+1;
+			char* dstname = strchr(tokenArgs[2]+1, '/')+1;
 			
-			// execute the command			
-			execvp(tokenArgs[0], tokenArgs);
+			// make sure we weren't passed nothing
+			if(strlen(srcname) == 0 || strlen(dstname) == 0){
+				fprintf(stderr, "What!? No filename?!\n");
+				return;
+			}
 			
-			// if we reached here, the command was invalid
-			cerr << "\nBad command!" << endl;
+			copyVirtToVirt(srcname, dstname, MBR, files, file_table, 
+					filesystem);
+			return;
 		}
-		else if(!runInBG){
+		else if(argOneInVirt && !argTwoInVirt){
 			
-			// this is done by the parent
-			pid_t tpid;
-			do{
-				tpid = wait(&childStatus);
-				
-				// catch any processes that may have terminated while we were
-				// busy with the user
-				if(tpid != childPID) processTerminated(tpid);
-			}while(tpid != childPID);
+			// break out the filename
+			char* filename = strchr(tokenArgs[1]+1, '/')+1;
+			
+			// make sure we weren't passed nothing
+			if(strlen(filename) == 0 || i < 3){
+				fprintf(stderr, "What!? No filename?!\n");
+				return;
+			}
 			
-			//cout << "Status of Child: " << childStatus << endl;
+			copyVirtToHost(filename, tokenArgs[2], MBR, files, file_table,
+					filesystem);
+			return;
 		}
+		else if(!argOneInVirt && argTwoInVirt){	
+
+			// break out the filename
+			char* filename = strchr(tokenArgs[2]+1, '/')+1;
+			
+			// make sure we weren't passed nothing
+			if(strlen(filename) == 0){
+				fprintf(stderr, "What!? No filename?!\n");
+				return;
+			}
 		
-		// make sure nothing is sitting in the buffer
-		fflush(stdout);
+			copyHostToVirt(tokenArgs[1], filename, false, MBR, files, 
+					file_table, filesystem);
+			return;
+		}
 		
-		// clear the input buffer for the next read
-		resetBuf(buf);
+		// otherwise assumet the command is from the host -> host
+	}
+	else if(strncmp(buf, "cat", MAX_BUF_SIZE) == 0){
+		if(argOneInVirt){
+			
+			// break out the filename
+			char* filename = strchr(tokenArgs[1]+1, '/')+1;
+			
+			// make sure we weren't passed nothing
+			if(strlen(filename) == 0){
+				fprintf(stderr, "What!? No filename?!\n");
+				return;
+			}
+			
+			printFile(MBR, file_table, files, filename, filesystem);
+			
+			return;
+		}
+	}
+	
+	// a server's clients run their own host commands
+	if(serving){
+		fprintf(stderr, "Sorry, the server only runs commands on %s!\n", 
+			fsname);
+		return;
+	}
+	
+	// Run the command
+	pid_t childPID;
+	int childStatus;
+	
+	// create a new process
+	childPID = fork();
+	
+	// If zero, then this is the child running
+	if(childPID == 0){
+		
+		// execute the command			
+		execvp(tokenArgs[0], tokenArgs);
+		
+		// if we reached here, the command was invalid; don't let the child
+		// carry on as a second shell
+		cerr << "\nBad command!" << endl;
+		_exit(EXIT_FAILURE);
+	}
+	else if(!runInBG){
+		
+		// this is done by the parent
+		pid_t tpid;
+		do{
+			tpid = wait(&childStatus);
+			
+			// catch any processes that may have terminated while we were
+			// busy with the user
+			if(tpid != childPID) processTerminated(tpid);
+		}while(tpid != childPID);
+		
+		//cout << "Status of Child: " << childStatus << endl;
 	}
 }
 
@@ -741,402 +1621,5800 @@ bool inVirtualFileSystem(char* file_path, char* fs_name){
 	return false;
 }
 
+/*
+* Copies a file to a new name inside the volume without copying any data:
+* the new entry points at the same chain, and both files are marked shared.
+* Clusters get split off lazily, only once one of the files is rewritten.
+*/
 void copyVirtToVirt(char* src, char* dst, mbr* MBR, directory* files, 
-		unsigned int* file_table, FILE* fp){
-	
-}
-
-void copyHostToVirt(char* src, char* dst, mbr* MBR, directory* dir_table, 
-		unsigned int* file_table, FILE* filesystem, char* fsname){
+		unsigned int* file_table, volume* vol){
 	
 	// vars
-	unsigned int cluster_size = MBR->cluster_size, writeIndex, prevIndex;
-	int size;
-	FILE* host_file = fopen(src, "r");
-	char buf[cluster_size];
-	
-	// makes sure the file name isn't too long
+	unsigned int dir;
+	char* leaf;
+	entry_ref src_ref;
+	directory src_entry, dst_entry;
 	
-	// make sure the file actually exists
-	if(host_file == 0){
+	if(!findEntry(MBR, files, file_table, vol, src, &src_ref, &src_entry)){
 		fprintf(stderr, "Sorry, %s does not exist!\n", src);
 		return;
 	}
+	if((src_entry.type & TYPE_MASK) != TYPE_FILE){
+		fprintf(stderr, "Sorry, %s is a directory!\n", src);
+		return;
+	}
+	if(!findParent(MBR, files, file_table, vol, dst, &dir, &leaf)){
+		fprintf(stderr, "Sorry, there's no directory to put %s in!\n", dst);
+		return;
+	}
 	
-	// grab the size of the file, make sure we have enough space!
-	size = fsize(src);
-	
-	
+	// an inline file is simply copied, unless the new name is too long to
+	// leave room for the data, which then needs a cluster after all
+	if(src_entry.type & TYPE_INLINE){
+		dst_entry = src_entry;
+		dst_entry.timestamp = time(NULL);
+		if(strlen(leaf) < sizeof(dst_entry.name) 
+				&& !fitsInline(leaf, dst_entry.size)
+				&& !spillInline(MBR, file_table, vol, &dst_entry))
+			return;
+		if(!addEntry(MBR, files, file_table, vol, dir, leaf, &dst_entry)){
+			if(isClusterLink(dst_entry.index))
+				setFileTableEntry(file_table, dst_entry.index, FREE_CLUSTER);
+			return;
+		}
+		if(isClusterLink(dst_entry.index))
+			ref_counts[dst_entry.index]++;
+		commitCommand(vol, MBR, files, file_table);
+		return;
+	}
 	
-	// create an entry in the dir_table
-	unsigned int dir_index = findFreeDirEntry(MBR, dir_table);
+	// share the chain
+	dst_entry = src_entry;
+	dst_entry.type |= TYPE_SHARED;
+	dst_entry.timestamp = time(NULL);
+	if(!addEntry(MBR, files, file_table, vol, dir, leaf, &dst_entry))
+		return;
+	ref_counts[dst_entry.index]++;
 	
-	// write the file name
-	strcpy(dir_table[dir_index].name, dst);
+	// adding the copy can move the source along a slot, so look it up again
+	findEntry(MBR, files, file_table, vol, src, &src_ref, &src_entry);
+	src_entry.type |= TYPE_SHARED;
+	storeEntry(MBR, files, file_table, vol, src_ref, &src_entry);
+	
+	// lastly, write the tables to disk!
+	commitCommand(vol, MBR, files, file_table);
+}
+
+/*
+* Copies a file out of the volume onto the host.  The destination is sized
+* up front and filled with large sequential writes, however scattered the 
+* file's clusters are.
+*/
+void copyVirtToHost(char* src, char* dst, mbr* MBR, directory* files, 
+		unsigned int* file_table, volume* vol){
+	
+	// vars
+	unsigned int cluster_size = MBR->cluster_size, index, run, next;
+	size_t size, bytes, filled = 0, chunk, n;
+	int host_file;
+	char* buf;
+	entry_ref ref;
+	directory entry;
+	
+	if(!findEntry(MBR, files, file_table, vol, src, &ref, &entry)){
+		fprintf(stderr, "Sorry, %s does not exist!\n", src);
+		return;
+	}
+	if((entry.type & TYPE_MASK) != TYPE_FILE){
+		fprintf(stderr, "Sorry, %s is a directory!\n", src);
+		return;
+	}
+	
+	host_file = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(host_file < 0){
+		fprintf(stderr, "Sorry, couldn't create %s!\n", dst);
+		return;
+	}
+	if(entry.type & TYPE_COMPRESSED){
+		if(!unpackFile(MBR, file_table, vol, &entry, host_file, true))
+			fprintf(stderr, "Whoops! Couldn't copy all of %s!\n", src);
+		close(host_file);
+		return;
+	}
+	
+	// an inline file is already in hand
+	if(entry.type & TYPE_INLINE){
+		if(!fitsInline(entry.name, entry.size))
+			fprintf(stderr, "Woah! %s is corrupt!\n", src);
+		else if(!writeFully(host_file, inlineData(&entry), entry.size))
+			fprintf(stderr, "Whoops! Couldn't write to %s!\n", dst);
+		close(host_file);
+		return;
+	}
+	
+	// ask for all the space at once so the host can lay it out in one go
+	size = entry.size;
+	if(size != 0)
+		posix_fallocate(host_file, 0, size);
+	
+	// the buffer holds a whole number of clusters
+	chunk = COPY_CHUNK / cluster_size;
+	if(chunk == 0)
+		chunk = 1;
+	chunk *= cluster_size;
+	buf = (char*)malloc(chunk);
+	
+	// we read the image directly, so it has to be current
+	flushClusterCache(vol);
+	
+	// gather runs into the buffer, writing it out every time it fills
+	index = entry.index;
+	while(size != 0 && index < MAX_FILES){
+		run = chainRunLength(MBR, file_table, index, 
+			(size + cluster_size - 1) / cluster_size, &next);
+		bytes = (size_t)run * cluster_size;
+		if(bytes > size)
+			bytes = size;
+		
+		for(size_t off = 0; off < bytes; off += n){
+			n = bytes - off < chunk - filled ? bytes - off : chunk - filled;
+			if(!readClusters(MBR, buf + filled, index + off / cluster_size, 
+					n, vol)){
+				fprintf(stderr, "Whoops! Couldn't copy all of %s!\n", src);
+				free(buf);
+				close(host_file);
+				return;
+			}
+			filled += n;
+			if(filled == chunk){
+				if(!writeFully(host_file, buf, filled))
+					fprintf(stderr, "Whoops! Couldn't write to %s!\n", dst);
+				filled = 0;
+			}
+		}
+		
+		size -= bytes;
+		index = next;
+	}
+	if(filled != 0 && !writeFully(host_file, buf, filled))
+		fprintf(stderr, "Whoops! Couldn't write to %s!\n", dst);
+	
+	free(buf);
+	close(host_file);
+}
+
+/*
+* Claims a free directory slot for a new file and fills in its name, size,
+* type and timestamp.  The caller sets the first cluster and then indexes 
+* the entry.
+*
+* @returns				the new slot, or MAX_FILES (after saying why) if the
+*						file can't be created
+*/
+unsigned int newDirectoryEntry(mbr* MBR, directory* dir_table, char* name,
+		unsigned int size){
+	
+	// vars
+	unsigned int dir_index;
+	
+	// makes sure the file name isn't too long, or already taken
+	if(strlen(name) >= sizeof(dir_table[0].name)){
+		fprintf(stderr, "Sorry, %s is too long for a file name!\n", name);
+		return MAX_FILES;
+	}
+	if(findDirectoryIndexOfFile(dir_table, name) != MAX_FILES){
+		fprintf(stderr, "Sorry, %s already exists!\n", name);
+		return MAX_FILES;
+	}
+	
+	// create an entry in the dir_table
+	dir_index = findFreeDirEntry(MBR, dir_table);
+	if(dir_index == MAX_FILES){
+		fprintf(stderr, "Woah! No more room for file entries!\n");
+		return MAX_FILES;
+	}
+	
+	// write the file name
+	memset(dir_table[dir_index].name, 0, sizeof(dir_table[0].name));
+	strcpy(dir_table[dir_index].name, name);
 	
 	// setup the size/type/creation meta-data
 	dir_table[dir_index].size = size;
 	dir_table[dir_index].type = 0x00;
 	dir_table[dir_index].timestamp = time(NULL);
+	markDirectoryEntryDirty(dir_index);
+	
+	return dir_index;
+}
+
+void copyHostToVirt(char* src, char* dst, bool compress, mbr* MBR, 
+		directory* dir_table, unsigned int* file_table, volume* filesystem){
+	
+	// vars
+	unsigned int cluster_size = MBR->cluster_size, dir;
+	off_t size;
+	size_t packed;
+	int host_file = open(src, O_RDONLY);
+	char* leaf;
+	entry_ref ref;
+	directory entry;
+	char data[sizeof(entry.name)];
+	
+	// make sure the file actually exists
+	if(host_file < 0){
+		fprintf(stderr, "Sorry, %s does not exist!\n", src);
+		return;
+	}
+	
+	// grab the size of the file; directory entries only hold 32 bits of it
+	size = fsize(src);
+	if(size > UINT_MAX){
+		fprintf(stderr, "Sorry, %s is too big for this filesystem!\n", src);
+		close(host_file);
+		return;
+	}
+	
+	// a compressed file gets packed before anything else happens, and from
+	// then on the packed data is simply the file's contents
+	if(compress){
+		int packed_file = packHostFile(host_file, size, &packed);
+		close(host_file);
+		if(packed_file < 0 || packed > UINT_MAX){
+			fprintf(stderr, "Sorry, couldn't compress %s!\n", src);
+			if(packed_file >= 0)
+				close(packed_file);
+			return;
+		}
+		host_file = packed_file;
+		size = packed;
+	}
+	unsigned int needed = size == 0 ? 1 : 
+		(size + cluster_size - 1) / cluster_size;
+	posix_fadvise(host_file, 0, 0, POSIX_FADV_SEQUENTIAL);
+	
+	// copying over an existing file rewrites it in place; one small enough
+	// moves into its entry, and one that's outgrown its entry gets a chain
+	if(findEntry(MBR, dir_table, file_table, filesystem, dst, &ref, &entry)){
+		bool stored = false;
+		if((entry.type & TYPE_MASK) != TYPE_FILE)
+			fprintf(stderr, "Sorry, %s is a directory!\n", dst);
+		else if(fitsInline(entry.name, size)){
+			if(readFully(host_file, data, size) != (size_t)size)
+				fprintf(stderr, "Whoops! Couldn't read %s!\n", src);
+			else{
+				if(isClusterLink(entry.index)){
+					ref_counts[entry.index]--;
+					releaseChain(file_table, entry.index);
+				}
+				setInline(&entry, data, size);
+				stored = true;
+			}
+		}
+		else if(entry.type & TYPE_INLINE){
+			if(needed > findTotalFreeClusterCount())
+				fprintf(stderr, "Sorry, there isn't enough room for %s!\n", 
+					src);
+			else{
+				memset(inlineData(&entry), 0, inlineRoom(entry.name));
+				entry.type &= ~TYPE_INLINE;
+				entry.size = size;
+				entry.timestamp = time(NULL);
+				entry.index = appendHostData(MBR, file_table, filesystem, 
+					host_file, size, needed, MAX_FILES);
+				ref_counts[entry.index]++;
+				stored = true;
+			}
+		}
+		else
+			stored = overwriteFile(host_file, size, &entry, MBR, file_table, 
+				filesystem);
+		if(stored){
+			entry.type &= ~TYPE_COMPRESSED;
+			if(compress)
+				entry.type |= TYPE_COMPRESSED;
+			storeEntry(MBR, dir_table, file_table, filesystem, ref, &entry);
+			commitCommand(filesystem, MBR, dir_table, file_table);
+		}
+		close(host_file);
+		return;
+	}
+	if(!findParent(MBR, dir_table, file_table, filesystem, dst, &dir, &leaf)){
+		fprintf(stderr, "Sorry, there's no directory to put %s in!\n", dst);
+		close(host_file);
+		return;
+	}
+	
+	// a file small enough to fit in its entry never gets a cluster
+	if(fitsInline(leaf, size)){
+		if(readFully(host_file, data, size) != (size_t)size){
+			fprintf(stderr, "Whoops! Couldn't read %s!\n", src);
+			close(host_file);
+			return;
+		}
+		close(host_file);
+		memset(&entry, 0, sizeof(directory));
+		strcpy(entry.name, leaf);
+		entry.type = compress ? TYPE_FILE | TYPE_COMPRESSED : TYPE_FILE;
+		setInline(&entry, data, size);
+		if(addEntry(MBR, dir_table, file_table, filesystem, dir, leaf, &entry))
+			commitCommand(filesystem, MBR, dir_table, file_table);
+		return;
+	}
+	
+	// make sure we have enough space!
+	if(needed > findTotalFreeClusterCount()){
+		fprintf(stderr, "Sorry, there isn't enough room for %s!\n", src);
+		close(host_file);
+		return;
+	}
+	
+	// reserve the whole file up front and stream it in
+	memset(&entry, 0, sizeof(directory));
+	entry.size = size;
+	entry.type = compress ? TYPE_FILE | TYPE_COMPRESSED : TYPE_FILE;
+	entry.timestamp = time(NULL);
+	entry.index = appendHostData(MBR, file_table, filesystem, host_file, size,
+		needed, MAX_FILES);
+	close(host_file);
+	
+	// then give it a name; if that fails the data goes straight back
+	if(!addEntry(MBR, dir_table, file_table, filesystem, dir, leaf, &entry)){
+		releaseChain(file_table, entry.index);
+		return;
+	}
+	ref_counts[entry.index]++;
+	
+	// lastly, write the tables to disk!
+	commitCommand(filesystem, MBR, dir_table, file_table);
+}
+
+/*
+* Allocates clusters for the rest of a file in as few contiguous runs as the
+* free map allows, links them in after tail, and streams the host file into
+* each run with large writes.
+*
+* @param	host_file		where the data comes from
+* @param	size			how many bytes are left to read
+* @param	needed			how many clusters to add
+* @param	tail			the cluster to link the new ones after, or 
+*							MAX_FILES if they start a new chain
+*
+* @returns				the first of the new clusters
+*/
+unsigned int appendHostData(mbr* MBR, unsigned int* file_table, 
+		volume* filesystem, int host_file, size_t size, unsigned int needed,
+		unsigned int tail){
+	
+	// vars
+	unsigned int cluster_size = MBR->cluster_size, start, len, count, 
+		first = MAX_FILES;
+	
+	// prep for reading; the buffer holds a whole number of clusters
+	unsigned int chunk = COPY_CHUNK / cluster_size;
+	if(chunk == 0)
+		chunk = 1;
+	char* buf = (char*)malloc((size_t)chunk * cluster_size);
+	
+	while(needed != 0){
+		len = allocateRun(MBR, file_table, needed, &start);
+		needed -= len;
+		
+		// hook the run onto the end of the chain
+		if(first == MAX_FILES)
+			first = start;
+		if(tail != MAX_FILES)
+			setFileTableEntry(file_table, tail, start);
+		tail = start + len - 1;
+		
+		// read so long as we have data left!
+		for(unsigned int done = 0; done < len && size != 0; done += count){
+			
+			// read as much of the host file as fits in the buffer
+			size_t want = (size_t)(len - done < chunk ? len - done : chunk) 
+				* cluster_size, got;
+			if(want > size)
+				want = size;
+			got = readFully(host_file, buf, want);
+			
+			// pad out the last cluster and write the lot in one go
+			count = (want + cluster_size - 1) / cluster_size;
+			memset(buf + got, 0, (size_t)count * cluster_size - got);
+			writeClusters(MBR, start + done, count, buf, filesystem);
+			size -= want;
+		}
+	}
+	free(buf);
+	
+	return first;
+}
+
+/*
+* Rewrites an existing file in place from a host file.  Clusters the file
+* owns alone are simply reused; clusters it shares with copies are split off
+* (copy-on-write) as they are reached.  The chain then grows or shrinks to
+* fit the new size.
+*
+* @param	entry			the file's entry, updated here; the caller writes
+*							it back
+*
+* @returns				false (after saying why) if there wasn't room
+*/
+bool overwriteFile(int host_file, size_t size, directory* entry, mbr* MBR,
+		unsigned int* file_table, volume* filesystem){
+	
+	// vars
+	unsigned int cluster_size = MBR->cluster_size, 
+		needed = size == 0 ? 1 : (size + cluster_size - 1) / cluster_size,
+		prev = MAX_FILES, cur = entry->index, pos = 0, extra = 0;
+	char buf[cluster_size];
+	size_t total = size, want, got;
+	bool shared = false;
+	
+	// worst case every cluster we keep is shared and has to be split
+	for(unsigned int c = cur; pos < needed; pos++){
+		if(isClusterLink(c)){
+			shared = shared || ref_counts[c] > 1;
+			extra += shared;
+			c = file_table[c];
+		}
+		else
+			extra++;
+	}
+	if(extra > findTotalFreeClusterCount()){
+		fprintf(stderr, "Sorry, there isn't enough room to rewrite %s!\n",
+			entry->name);
+		return false;
+	}
+	
+	// rewrite the clusters the file already has
+	for(pos = 0; pos < needed && isClusterLink(cur); pos++){
+		cur = unshareCluster(MBR, file_table, entry, prev, cur, false, 
+			filesystem);
+		
+		want = size < cluster_size ? size : cluster_size;
+		got = readFully(host_file, buf, want);
+		memset(buf + got, 0, cluster_size - got);
+		writeCluster(MBR, cur, buf, filesystem);
+		size -= want;
+		
+		prev = cur;
+		cur = file_table[cur];
+	}
+	
+	// then either grow the chain or cut off what's left of it
+	if(pos < needed)
+		appendHostData(MBR, file_table, filesystem, host_file, size, 
+			needed - pos, prev);
+	else if(isClusterLink(cur)){
+		setFileTableEntry(file_table, prev, LAST_CLUSTER);
+		releaseChain(file_table, cur);
+	}
+	
+	entry->size = total;
+	entry->timestamp = time(NULL);
+	
+	return true;
+}
+
+/*
+* Copies a host directory tree into the volume.  The tree is walked and 
+* sized first, and nothing is made unless it all fits; then the 
+* subdirectories are made and a pool of threads reads the files in, each 
+* one allocating its file's clusters in a batch under a lock and writing 
+* the data without it.  The entries go in afterwards and everything is 
+* committed once.
+*
+* @param	src				the host directory
+* @param	dst				where it goes, without the filesystem name; it's
+*							made if it isn't there, and filled if it is
+*/
+void importTree(char* src, char* dst, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table, volume* vol){
+	
+	// vars
+	unsigned int cluster_size = MBR->cluster_size, count = 0, cap = 0, 
+		dir_count = 0, dir_cap = 0, made = 0, kept = 0, done = 0, threads, 
+		needed = 0, half, len;
+	unsigned long bytes = 0;
+	import_file* files = NULL;
+	import_dir* dirs = NULL;
+	import_job job;
+	struct stat info;
+	struct timeval start, end;
+	double seconds;
+	
+	gettimeofday(&start, NULL);
+	if(stat(src, &info) != 0 || !S_ISDIR(info.st_mode)){
+		fprintf(stderr, "Sorry, %s isn't a directory!\n", src);
+		return;
+	}
+	
+	// a trailing slash on the destination means nothing here
+	len = strlen(dst);
+	while(len != 0 && dst[len - 1] == '/')
+		dst[--len] = '\0';
+	if(!listImportDirectory(dst, MAX_FILES, MBR, dir_table, file_table, vol, 
+			&dirs, &dir_count, &dir_cap))
+		return;
+	
+	// list the directories and files without touching the volume, then make
+	// sure it all fits: the files' clusters, and the directories' too (a full
+	// directory cluster splits in half, so every half cluster's worth of new
+	// entries may cost one; the root is a fixed table and never does)
+	collectImports(src, 0, MBR, dir_table, file_table, vol, &files, &count, 
+		&cap, &dirs, &dir_count, &dir_cap);
+	half = cluster_size / sizeof(directory) / 2;
+	if(half == 0)
+		half = 1;
+	for(unsigned int i = 0; i < count; i++)
+		if(!fitsInline(files[i].leaf, files[i].size))
+			needed += (files[i].size + cluster_size - 1) / cluster_size;
+	for(unsigned int i = 0; i < dir_count; i++)
+		if(dirs[i].path[0] != '\0')
+			needed += (dirs[i].added + dirs[i].made + half - 1) / half;
+	if(needed > findTotalFreeClusterCount()){
+		fprintf(stderr, "Sorry, there isn't enough room for %s!\n", src);
+		freeImports(files, count, dirs, dir_count);
+		return;
+	}
+	
+	// now make the directories, parents first; anything under one that 
+	// couldn't be made is dropped
+	for(unsigned int i = 0; i < dir_count; i++){
+		import_dir* d = &dirs[i];
+		
+		if(!d->made)
+			continue;
+		if(d->parent != MAX_FILES && dirs[d->parent].made 
+				&& dirs[d->parent].cluster == MAX_FILES)
+			continue;
+		if(importDirectory(d->path, MBR, dir_table, file_table, vol, 
+				&d->cluster))
+			made++;
+		else
+			d->cluster = MAX_FILES;
+	}
+	for(unsigned int i = 0; i < count; i++){
+		import_dir* d = &dirs[files[i].dir];
+		
+		if(d->made && d->cluster == MAX_FILES){
+			free(files[i].host);
+			free(files[i].leaf);
+			continue;
+		}
+		files[i].dir = d->cluster;
+		files[kept++] = files[i];
+	}
+	count = kept;
+	
+	// biggest first, so the threads finish at about the same time
+	qsort(files, count, sizeof(import_file), compareImports);
+	job.count = count;
+	
+	// the data goes around the cluster cache, so it has to be current
+	flushClusterCache(vol);
+	
+	threads = sysconf(_SC_NPROCESSORS_ONLN) < 1 ? 1 
+		: sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads > IMPORT_THREADS)
+		threads = IMPORT_THREADS;
+	if(threads > job.count)
+		threads = job.count == 0 ? 1 : job.count;
+	job.files = files;
+	job.next = 0;
+	job.MBR = MBR;
+	job.file_table = file_table;
+	job.vol = vol;
+	pthread_mutex_init(&job.lock, NULL);
+	
+	pthread_t workers[threads];
+	bool started[threads];
+	for(unsigned int t = 0; t < threads; t++){
+		started[t] = pthread_create(&workers[t], NULL, importFiles, &job) 
+			== 0;
+		if(!started[t])
+			importFiles(&job);
+	}
+	for(unsigned int t = 0; t < threads; t++)
+		if(started[t])
+			pthread_join(workers[t], NULL);
+	pthread_mutex_destroy(&job.lock);
+	
+	// now the entries, one file at a time
+	for(unsigned int i = 0; i < job.count; i++){
+		import_file* file = &files[i];
+		directory entry;
+		
+		// the workers left the checksums they wrote to be marked here, and
+		// anything the cache held for these clusters is out of date
+		for(unsigned int c = file->first, run, next; isClusterLink(c); 
+				c = next){
+			run = chainRunLength(MBR, file_table, c, MAX_FILES, &next);
+			if(sums.table != NULL)
+				markDirty(&sum_dirty, (size_t)c * sizeof(unsigned int), 
+					sizeof(unsigned int) * run);
+			for(unsigned int k = 0; k < run; k++)
+				invalidateCachedCluster(c + k);
+		}
+		
+		if(!file->ok){
+			fprintf(stderr, "Whoops! Couldn't read %s!\n", file->host);
+			releaseChain(file_table, file->first);
+			continue;
+		}
+		memset(&entry, 0, sizeof(directory));
+		strcpy(entry.name, file->leaf);
+		entry.type = TYPE_FILE;
+		if(file->first == MAX_FILES)
+			setInline(&entry, file->data, file->size);
+		else{
+			entry.index = file->first;
+			entry.size = file->size;
+			entry.timestamp = time(NULL);
+		}
+		if(!addEntry(MBR, dir_table, file_table, vol, file->dir, file->leaf,
+				&entry)){
+			releaseChain(file_table, file->first);
+			continue;
+		}
+		if(isClusterLink(entry.index))
+			ref_counts[entry.index]++;
+		bytes += file->size;
+		done++;
+	}
+	
+	// lastly, write the tables to disk!
+	commitCommand(vol, MBR, dir_table, file_table);
+	gettimeofday(&end, NULL);
+	
+	seconds = (end.tv_sec - start.tv_sec) 
+		+ (end.tv_usec - start.tv_usec) / 1000000.0;
+	printf("Imported %u files (%.1fMB) and made %u directories on %u "
+		"thread(s) in %.3fs (%.1fMB/s)\n", done, bytes / (double)MEGABYTE, 
+		made, threads, seconds, 
+		seconds > 0 ? bytes / (double)MEGABYTE / seconds : 0);
+	
+	freeImports(files, count, dirs, dir_count);
+}
+
+/*
+* Walks a host directory for importTree, listing the subdirectories and the
+* regular files to bring in.  Nothing in the volume is changed.
+*
+* @param	host			the host directory
+* @param	at				the same directory's place in the directory list
+*/
+void collectImports(char* host, unsigned int at, mbr* MBR, 
+		directory* dir_table, unsigned int* file_table, volume* vol, 
+		import_file** list, unsigned int* count, unsigned int* cap, 
+		import_dir** dirs, unsigned int* dir_count, unsigned int* dir_cap){
+	
+	// vars
+	DIR* listing = opendir(host);
+	struct dirent* item;
+	struct stat info;
+	char host_path[PATH_MAX], path[PATH_MAX], path_here[PATH_MAX];
+	bool made = (*dirs)[at].made;
+	entry_ref ref;
+	directory entry;
+	import_file file;
+	
+	if(listing == NULL){
+		fprintf(stderr, "Sorry, couldn't read %s!\n", host);
+		return;
+	}
+	
+	// the list moves as it grows, so keep a copy of the path
+	strcpy(path, (*dirs)[at].path);
+	while((item = readdir(listing)) != NULL){
+		if(strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0)
+			continue;
+		snprintf(host_path, PATH_MAX, "%s/%s", host, item->d_name);
+		snprintf(path_here, PATH_MAX, "%s%s%s", path, 
+			path[0] == '\0' ? "" : "/", item->d_name);
+		if(stat(host_path, &info) != 0)
+			continue;
+		
+		if(S_ISDIR(info.st_mode)){
+			unsigned int sub = *dir_count;
+			
+			if(listImportDirectory(path_here, at, MBR, dir_table, file_table,
+					vol, dirs, dir_count, dir_cap))
+				collectImports(host_path, sub, MBR, dir_table, file_table, 
+					vol, list, count, cap, dirs, dir_count, dir_cap);
+			continue;
+		}
+		
+		// only regular files with names we can hold, that aren't there yet
+		if(!S_ISREG(info.st_mode)){
+			fprintf(stderr, "Sorry, %s isn't a regular file!\n", host_path);
+			continue;
+		}
+		if(strlen(item->d_name) >= sizeof(entry.name)){
+			fprintf(stderr, "Sorry, %s is too long for a file name!\n", 
+				item->d_name);
+			continue;
+		}
+		if(info.st_size > UINT_MAX){
+			fprintf(stderr, "Sorry, %s is too big for this filesystem!\n", 
+				host_path);
+			continue;
+		}
+		if(!made && findEntry(MBR, dir_table, file_table, vol, path_here, 
+				&ref, &entry)){
+			fprintf(stderr, "Sorry, %s already exists!\n", path_here);
+			continue;
+		}
+		
+		file.host = strdup(host_path);
+		file.leaf = strdup(item->d_name);
+		file.dir = at;
+		file.size = info.st_size;
+		file.first = MAX_FILES;
+		file.ok = false;
+		if(*count == *cap){
+			*cap = *cap == 0 ? 64 : *cap * 2;
+			*list = (import_file*)realloc(*list, sizeof(import_file) * *cap);
+		}
+		(*list)[(*count)++] = file;
+		(*dirs)[at].added++;
+	}
+	closedir(listing);
+}
+
+/*
+* Adds a directory to importTree's list, noting whether it has to be made.
+* Under a directory that's being made, nothing can be there yet, so the 
+* volume isn't searched.
+*
+* @param	parent			its parent's place in the list, MAX_FILES for the
+*							top of the import
+*
+* @returns				false (after saying why) if something else has the 
+*						name
+*/
+bool listImportDirectory(char* path, unsigned int parent, mbr* MBR, 
+		directory* dir_table, unsigned int* file_table, volume* vol, 
+		import_dir** dirs, unsigned int* dir_count, unsigned int* dir_cap){
+	
+	// vars
+	import_dir d;
+	entry_ref ref;
+	directory entry;
+	
+	d.path = strdup(path);
+	d.cluster = MAX_FILES;
+	d.parent = parent;
+	d.added = 0;
+	d.made = parent != MAX_FILES && (*dirs)[parent].made;
+	if(!d.made && path[0] != '\0'){
+		if(!findEntry(MBR, dir_table, file_table, vol, path, &ref, &entry))
+			d.made = true;
+		else if((entry.type & TYPE_MASK) != TYPE_DIRECTORY){
+			fprintf(stderr, "Sorry, %s isn't a directory!\n", path);
+			free(d.path);
+			return false;
+		}
+		else
+			d.cluster = entry.index;
+	}
+	
+	if(*dir_count == *dir_cap){
+		*dir_cap = *dir_cap == 0 ? 16 : *dir_cap * 2;
+		*dirs = (import_dir*)realloc(*dirs, sizeof(import_dir) * *dir_cap);
+	}
+	(*dirs)[(*dir_count)++] = d;
+	if(d.made && parent != MAX_FILES)
+		(*dirs)[parent].added++;
+	return true;
+}
+
+/*
+* Frees importTree's lists.
+*/
+void freeImports(import_file* files, unsigned int count, import_dir* dirs,
+		unsigned int dir_count){
+	
+	for(unsigned int i = 0; i < count; i++){
+		free(files[i].host);
+		free(files[i].leaf);
+	}
+	free(files);
+	for(unsigned int i = 0; i < dir_count; i++)
+		free(dirs[i].path);
+	free(dirs);
+}
+
+/*
+* Finds a directory in the volume for importTree, making it if it isn't 
+* there.
+*
+* @param	dir				receives its first cluster
+*
+* @returns				false (after saying why) if something else has the
+*						name or the directory couldn't be made
+*/
+bool importDirectory(char* path, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table, volume* vol, unsigned int* dir){
+	
+	// vars
+	entry_ref ref;
+	directory entry;
+	
+	if(findEntry(MBR, dir_table, file_table, vol, path, &ref, &entry)){
+		if((entry.type & TYPE_MASK) != TYPE_DIRECTORY){
+			fprintf(stderr, "Sorry, %s isn't a directory!\n", path);
+			return false;
+		}
+		*dir = entry.index;
+		return true;
+	}
+	*dir = addDirectory(path, MBR, dir_table, file_table, vol);
+	return *dir != MAX_FILES;
+}
+
+/*
+* Import thread: takes files off the list until there are none left.  Small
+* files are read into the list for their entries; the rest get all their 
+* clusters at once under the lock, then are streamed straight into the 
+* image with their checksums worked out on the way.
+*/
+void* importFiles(void* arg){
+	
+	// vars
+	import_job* job = (import_job*)arg;
+	mbr* MBR = job->MBR;
+	volume* vol = job->vol;
+	unsigned int* table = job->file_table;
+	unsigned int cluster_size = MBR->cluster_size, i, needed, len, start, 
+		tail, run, next, count, chunk = COPY_CHUNK / cluster_size;
+	size_t size, want;
+	int host_file;
+	char* buf;
+	
+	if(chunk == 0)
+		chunk = 1;
+	buf = (char*)malloc((size_t)chunk * cluster_size);
+	
+	while((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) 
+			< job->count){
+		import_file* file = &job->files[i];
+		
+		host_file = open(file->host, O_RDONLY);
+		if(host_file < 0)
+			continue;
+		size = file->size;
+		if(fitsInline(file->leaf, size)){
+			file->ok = readFully(host_file, file->data, size) == size;
+			close(host_file);
+			continue;
+		}
+		posix_fadvise(host_file, 0, 0, POSIX_FADV_SEQUENTIAL);
+		
+		// the whole file's clusters in one trip to the allocator
+		needed = (size + cluster_size - 1) / cluster_size;
+		tail = MAX_FILES;
+		pthread_mutex_lock(&job->lock);
+		while(needed != 0){
+			len = allocateRun(MBR, table, needed, &start);
+			needed -= len;
+			if(file->first == MAX_FILES)
+				file->first = start;
+			if(tail != MAX_FILES)
+				setFileTableEntry(table, tail, start);
+			tail = start + len - 1;
+		}
+		pthread_mutex_unlock(&job->lock);
+		
+		// then fill it a run at a time, with nobody else touching the chain
+		file->ok = true;
+		for(unsigned int c = file->first; isClusterLink(c) && size != 0; 
+				c = next){
+			run = chainRunLength(MBR, table, c, MAX_FILES, &next);
+			for(unsigned int done = 0; done < run && size != 0; 
+					done += count){
+				want = (size_t)(run - done < chunk ? run - done : chunk) 
+					* cluster_size;
+				if(want > size)
+					want = size;
+				if(readFully(host_file, buf, want) != want)
+					file->ok = false;
+				count = (want + cluster_size - 1) / cluster_size;
+				memset(buf + want, 0, (size_t)count * cluster_size - want);
+				
+				for(unsigned int k = 0; sums.table != NULL && k < count; k++)
+					sums.table[c + done + k] = crc32c(buf 
+						+ (size_t)k * cluster_size, cluster_size);
+				if(vol->map != NULL){
+					if(inMapping(vol, c + done, 
+							(off_t)(c + done) * cluster_size, 
+							(size_t)count * cluster_size))
+						memcpy(vol->map + (off_t)(c + done) * cluster_size, 
+							buf, (size_t)count * cluster_size);
+					else
+						file->ok = false;
+				}
+				else if(pwrite(vol->fd, buf, (size_t)count * cluster_size, 
+						(off_t)(c + done) * cluster_size) 
+						!= (ssize_t)count * cluster_size)
+					file->ok = false;
+				size -= want;
+			}
+		}
+		close(host_file);
+	}
+	free(buf);
+	return NULL;
+}
+
+int compareImports(const void* a, const void* b){
+	size_t x = ((import_file*)a)->size, y = ((import_file*)b)->size;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+* Compresses a host file into an anonymous in-memory file, a block at a 
+* time.  Each block is LZ packed on its own, or kept as it is if packing
+* doesn't make it any smaller, so a block never grows by more than its
+* header.
+*
+* @param	host_file		where the data comes from
+* @param	size			how many bytes to read from it
+* @param	packed			receives the size of the packed data
+*
+* @returns				a descriptor for the packed data, positioned at its
+*						start, or -1 if the file couldn't be packed
+*/
+int packHostFile(int host_file, size_t size, size_t* packed){
+	
+	// vars
+	int fd = memfd_create("packed", 0);
+	unsigned char* in, * out, * data;
+	unsigned int* table;
+	pack_header header;
+	pack_block block;
+	bool ok;
+	
+	if(fd < 0)
+		return -1;
+	in = (unsigned char*)malloc(PACK_BLOCK);
+	out = (unsigned char*)malloc(PACK_BLOCK);
+	table = (unsigned int*)malloc(sizeof(unsigned int) << LZ_HASH_BITS);
+	
+	header.magic = PACK_MAGIC;
+	header.size = size;
+	header.block = PACK_BLOCK;
+	ok = writeFully(fd, (char*)&header, sizeof(pack_header));
+	*packed = sizeof(pack_header);
+	
+	while(ok && size != 0){
+		block.size = readFully(host_file, (char*)in, 
+			size < PACK_BLOCK ? size : PACK_BLOCK);
+		if(block.size == 0)
+			break;
+		
+		block.packed = lzCompress(in, block.size, out, block.size, table);
+		data = out;
+		if(block.packed == 0){
+			block.packed = block.size | PACK_STORED;
+			data = in;
+		}
+		ok = writeFully(fd, (char*)&block, sizeof(pack_block)) 
+			&& writeFully(fd, (char*)data, block.packed & ~PACK_STORED);
+		*packed += sizeof(pack_block) + (block.packed & ~PACK_STORED);
+		size -= block.size;
+	}
+	free(in);
+	free(out);
+	free(table);
+	
+	// the host file can't have come up short, the size is already promised
+	if(!ok || size != 0 || lseek(fd, 0, SEEK_SET) != 0){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+* Writes out the original contents of a compressed file, unpacking it a 
+* block at a time as its clusters are read.
+*
+* @param	entry			the file's entry
+* @param	out_fd			where the contents go
+* @param	preallocate		size out_fd for the whole file first
+*
+* @returns				false (after saying why) if the file couldn't all
+*						be unpacked and written
+*/
+bool unpackFile(mbr* MBR, unsigned int* file_table, volume* vol, 
+		directory* entry, int out_fd, bool preallocate){
+	
+	// vars
+	chain_reader reader;
+	pack_header header;
+	pack_block block;
+	unsigned char* in, * out, * data;
+	size_t left, len;
+	bool ok = true;
+	
+	openChain(MBR, &reader, entry);
+	if(!readChain(MBR, file_table, vol, &reader, &header, sizeof(pack_header))
+			|| header.magic != PACK_MAGIC || header.block == 0 
+			|| header.block > PACK_BLOCK){
+		fprintf(stderr, "Woah! %s isn't a valid compressed file!\n", 
+			entry->name);
+		free(reader.buf);
+		return false;
+	}
+	if(preallocate && header.size != 0)
+		posix_fallocate(out_fd, 0, header.size);
+	
+	in = (unsigned char*)malloc(header.block);
+	out = (unsigned char*)malloc(header.block);
+	for(left = header.size; ok && left != 0; left -= block.size){
+		
+		// a block has to be no bigger than it claims and unpack to exactly
+		// the size it claims
+		ok = readChain(MBR, file_table, vol, &reader, &block, 
+			sizeof(pack_block));
+		len = block.packed & ~PACK_STORED;
+		ok = ok && block.size != 0 && block.size <= header.block 
+			&& block.size <= left && len <= header.block
+			&& readChain(MBR, file_table, vol, &reader, in, len);
+		if(ok && (block.packed & PACK_STORED)){
+			ok = len == block.size;
+			data = in;
+		}
+		else if(ok){
+			ok = lzDecompress(in, len, out, block.size);
+			data = out;
+		}
+		if(!ok){
+			fprintf(stderr, "Woah! %s is corrupt!\n", entry->name);
+			break;
+		}
+		
+		if(!writeFully(out_fd, (char*)data, block.size)){
+			ok = false;
+			break;
+		}
+	}
+	free(in);
+	free(out);
+	free(reader.buf);
+	
+	return ok;
+}
+
+/*
+* A single pass LZ compressor in the style of LZ4: greedy, with a hash table
+* of the last place each four byte sequence was seen.  The output is a list
+* of sequences, each a token (literal count in the high nibble, match 
+* length less four in the low one, a nibble of 15 meaning more length bytes
+* follow), the literals, then a two byte offset back to the match.  The
+* last sequence is just literals.
+*
+* @param	table			scratch space of 2^LZ_HASH_BITS entries
+*
+* @returns				the packed size, or 0 if it wouldn't fit in cap
+*/
+size_t lzCompress(const unsigned char* src, size_t len, unsigned char* dst, 
+		size_t cap, unsigned int* table){
+	
+	// vars
+	size_t ip = 0, anchor = 0, op = 0, match;
+	unsigned int seq, hash, ref;
+	
+	memset(table, 0, sizeof(unsigned int) << LZ_HASH_BITS);
+	while(ip + 4 <= len){
+		memcpy(&seq, src + ip, 4);
+		hash = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+		ref = table[hash];
+		table[hash] = ip;
+		if(ref >= ip || ip - ref > 0xFFFF || memcmp(src + ref, src + ip, 4)){
+			ip++;
+			continue;
+		}
+		
+		for(match = 4; ip + match < len && src[ref + match] == src[ip + match];
+				match++)
+			;
+		if(!lzEmit(dst, cap, &op, src + anchor, ip - anchor, ip - ref, 
+				match))
+			return 0;
+		ip += match;
+		anchor = ip;
+	}
+	if(!lzEmit(dst, cap, &op, src + anchor, len - anchor, 0, 0))
+		return 0;
+	return op;
+}
+
+/*
+* Appends one sequence to the compressor's output; a match of 0 ends it.
+*
+* @returns				false if it doesn't fit
+*/
+bool lzEmit(unsigned char* dst, size_t cap, size_t* op, 
+		const unsigned char* lit, size_t lit_len, unsigned int offset, 
+		size_t match){
+	
+	// vars
+	size_t need = 1 + lit_len + lit_len / 255 + 1 
+		+ (match != 0 ? 2 + match / 255 + 1 : 0), n;
+	unsigned char* p = dst + *op, * token = p++;
+	
+	if(*op + need > cap)
+		return false;
+	
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if(lit_len >= 15){
+		for(n = lit_len - 15; n >= 255; n -= 255)
+			*p++ = 255;
+		*p++ = n;
+	}
+	memcpy(p, lit, lit_len);
+	p += lit_len;
+	
+	if(match != 0){
+		*p++ = offset & 0xFF;
+		*p++ = offset >> 8;
+		*token |= match - 4 < 15 ? match - 4 : 15;
+		if(match - 4 >= 15){
+			for(n = match - 4 - 15; n >= 255; n -= 255)
+				*p++ = 255;
+			*p++ = n;
+		}
+	}
+	*op = p - dst;
+	return true;
+}
+
+/*
+* Unpacks what lzCompress() packed.  Every length and offset is checked, so
+* damaged data fails rather than running off either buffer.
+*
+* @returns				false unless it unpacked to exactly size bytes
+*/
+bool lzDecompress(const unsigned char* src, size_t len, unsigned char* dst,
+		size_t size){
+	
+	// vars
+	size_t ip = 0, op = 0, lit_len, match, offset;
+	unsigned char token, more;
+	
+	while(ip < len){
+		token = src[ip++];
+		lit_len = token >> 4;
+		if(lit_len == 15){
+			do{
+				if(ip >= len)
+					return false;
+				more = src[ip++];
+				lit_len += more;
+			}while(more == 255);
+		}
+		if(lit_len > len - ip || lit_len > size - op)
+			return false;
+		memcpy(dst + op, src + ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+		
+		// the last sequence has no match
+		if(ip == len)
+			break;
+		if(len - ip < 2)
+			return false;
+		offset = src[ip] | src[ip + 1] << 8;
+		ip += 2;
+		match = (token & 0x0F) + 4;
+		if((token & 0x0F) == 15){
+			do{
+				if(ip >= len)
+					return false;
+				more = src[ip++];
+				match += more;
+			}while(more == 255);
+		}
+		if(offset == 0 || offset > op || match > size - op)
+			return false;
+		
+		// matches can overlap what they're copying
+		if(offset >= match)
+			memcpy(dst + op, dst + op - offset, match);
+		else
+			for(size_t k = 0; k < match; k++)
+				dst[op + k] = dst[op - offset + k];
+		op += match;
+	}
+	return op == size;
+}
+
+/*
+* Gets ready to read a file's data from the start.  The caller frees the 
+* reader's buffer when it's done.
+*/
+void openChain(mbr* MBR, chain_reader* reader, directory* entry){
+	reader->cluster = entry->index;
+	reader->offset = 0;
+	reader->left = entry->size;
+	reader->buf = NULL;
+	reader->data = NULL;
+	if(!(entry->type & TYPE_INLINE))
+		reader->buf = (char*)malloc(MBR->cluster_size);
+	else if(fitsInline(entry->name, entry->size))
+		reader->data = inlineData(entry);
+	else
+		reader->left = 0;
+}
+
+/*
+* Reads the next len bytes of a file's data.
+*
+* @returns				false if the file (or its chain) ends first
+*/
+bool readChain(mbr* MBR, unsigned int* file_table, volume* vol, 
+		chain_reader* reader, void* dst, size_t len){
+	
+	// vars
+	unsigned int cluster_size = MBR->cluster_size;
+	size_t n;
+	
+	if(reader->data != NULL){
+		if(len > reader->left)
+			return false;
+		memcpy(dst, reader->data, len);
+		reader->data += len;
+		reader->left -= len;
+		return true;
+	}
+	
+	while(len != 0){
+		if(reader->left == 0 || !isClusterLink(reader->cluster) 
+				|| reader->cluster >= MAX_FILES)
+			return false;
+		if(reader->offset == 0 && !readCluster(MBR, reader->buf, 
+				reader->cluster, cluster_size, vol))
+			return false;
+		
+		n = cluster_size - reader->offset;
+		if(n > len)
+			n = len;
+		if(n > reader->left)
+			n = reader->left;
+		memcpy(dst, reader->buf + reader->offset, n);
+		dst = (char*)dst + n;
+		len -= n;
+		reader->left -= n;
+		reader->offset += n;
+		if(reader->offset == cluster_size){
+			reader->offset = 0;
+			reader->cluster = file_table[reader->cluster];
+		}
+	}
+	return true;
+}
+
+/*
+* Checks that a range of the image lies inside the mapping before it's
+* touched; a damaged FAT can point anywhere, and the image may be shorter
+* than its MBR says.  Says so if it doesn't.
+*
+* @param	index			the cluster the range starts at, for the message
+*/
+bool inMapping(volume* vol, unsigned int index, off_t loc, size_t len){
+	if(loc >= 0 && (size_t)loc <= vol->length 
+			&& len <= vol->length - (size_t)loc)
+		return true;
+	fprintf(stderr, "Woah! Cluster %u is past the end of %s!\n", index, 
+		vol->name);
+	return false;
+}
+
+/*
+* Reads the first size bytes of a cluster; from the cluster cache if it's
+* there, otherwise with a single positioned read, or straight out of the
+* mapping in mmap mode.  Whatever comes off the disk is checked against the
+* cluster's checksum, which takes the whole cluster.
+*
+* @returns				false (after saying why) if the cluster couldn't be
+*						read or doesn't match its checksum; buf still gets 
+*						whatever was there, for callers that only pass the
+*						bytes along unchanged
+*/
+bool readCluster(mbr* MBR, char* buf, unsigned int index, unsigned int size,
+		volume* vol){
+	
+	// vars
+	unsigned int cluster_size = MBR->cluster_size;
+	off_t loc = (off_t)cluster_size * index;
+	cache_entry* entry;
+	bool ok;
+	
+	if(vol->map != NULL){
+		if(!inMapping(vol, index, loc, cluster_size)){
+			memset(buf, 0, size);
+			return false;
+		}
+		ok = verifyClusters(vol->map + loc, index, 1, cluster_size) == 0;
+		memcpy(buf, vol->map + loc, size);
+		return ok;
+	}
+	
+	// the cache won't keep a bad copy, so that one comes straight off the
+	// disk again
+	if(cache.capacity != 0){
+		entry = cacheCluster(vol, index, true);
+		if(entry != NULL){
+			memcpy(buf, entry->data, size);
+			return true;
+		}
+		if(pread(vol->fd, buf, size, loc) != size)
+			memset(buf, 0, size);
+		return false;
+	}
+	
+	if(sums.table != NULL && size < cluster_size){
+		char* whole = (char*)malloc(cluster_size);
+		ok = readCluster(MBR, whole, index, cluster_size, vol);
+		memcpy(buf, whole, size);
+		free(whole);
+		return ok;
+	}
+	
+	// read the data from the filesystem
+	if(pread(vol->fd, buf, size, loc) != size){
+		fprintf(stderr, "Whoops! Couldn't read cluster %u!\n", index);
+		return false;
+	}
+	return verifyClusters(buf, index, size / cluster_size, cluster_size) == 0;
+}
+
+/*
+* Writes a whole cluster with a single positioned write (or a copy into the
+* mapping).  With the cluster cache on, the write only dirties the cached 
+* copy.  Nothing is forced out to the disk until the next syncVolume().
+*/
+void writeCluster(mbr* MBR, unsigned int index, char* buf, volume* vol){
+	
+	// vars
+	unsigned int cluster_size = MBR->cluster_size;
+	off_t loc = (off_t)cluster_size * index;
+	
+	recordChecksums(buf, index, 1, cluster_size);
+	if(vol->map != NULL){
+		if(inMapping(vol, index, loc, cluster_size))
+			memcpy(vol->map + loc, buf, cluster_size);
+		return;
+	}
+	
+	if(cache.capacity != 0){
+		cache_entry* entry = cacheCluster(vol, index, false);
+		memcpy(entry->data, buf, cluster_size);
+		entry->dirty = true;
+		return;
+	}
+	
+	// write to our filesystem
+	if(pwrite(vol->fd, buf, cluster_size, loc) != cluster_size)
+		fprintf(stderr, "Whoops! Couldn't write cluster %u!\n", index);
+}
+
+/*
+* Writes count adjacent clusters from buf with one large write, going around
+* the cluster cache (any stale copies in it are dropped).
+*/
+void writeClusters(mbr* MBR, unsigned int index, unsigned int count, 
+		char* buf, volume* vol){
+	
+	// vars
+	size_t len = (size_t)count * MBR->cluster_size;
+	off_t loc = (off_t)MBR->cluster_size * index;
+	
+	recordChecksums(buf, index, count, MBR->cluster_size);
+	if(vol->map != NULL){
+		if(inMapping(vol, index, loc, len))
+			memcpy(vol->map + loc, buf, len);
+		return;
+	}
+	
+	for(unsigned int i = 0; i < count; i++)
+		invalidateCachedCluster(index + i);
+	if(pwrite(vol->fd, buf, len, loc) != (ssize_t)len)
+		fprintf(stderr, "Whoops! Couldn't write clusters %u-%u!\n", index,
+			index + count - 1);
+}
+
+/*
+* Measures the run of physically adjacent clusters a chain has starting at a
+* given cluster.
+*
+* @param	MBR				the filesystem's master boot record
+* @param	file_table		the in-memory FAT
+* @param	start			the first cluster of the run
+* @param	max				don't bother counting past this many clusters
+* @param	next			receives the cluster following the run (or the
+*							end of chain marker)
+*
+* @returns				the number of clusters in the run
+*/
+unsigned int chainRunLength(mbr* MBR, unsigned int* file_table, 
+		unsigned int start, unsigned int max, unsigned int* next){
+	
+	// vars
+	unsigned int MAX_FILES = clusterCount(MBR), len = 1;
+	
+	*next = file_table[start];
+	while(len < max && *next == start + len && *next < MAX_FILES){
+		*next = file_table[*next];
+		len++;
+	}
+	return len;
+}
+
+/*
+* Copies bytes from the image, starting at a cluster, to a descriptor 
+* without bringing them into user space; sendfile() moves them kernel side
+* (or, in mmap mode, write() straight out of the mapping).  Checksums mean
+* the data has to be looked at, so on an image with them each chunk is 
+* mapped, checked where it lies in the page cache and written out from 
+* there, which still saves the copy into a buffer.  Falls back to reading 
+* through a buffer if the descriptor won't take sendfile() or the chunk 
+* can't be mapped.
+*
+* @returns				false if the data couldn't all be written
+*/
+bool sendClusters(mbr* MBR, volume* vol, int out_fd, unsigned int index, 
+		size_t bytes){
+	
+	// vars
+	unsigned int cluster_size = MBR->cluster_size;
+	off_t loc = (off_t)cluster_size * index;
+	ssize_t sent;
+	
+	if(vol->map != NULL){
+		unsigned int count = (bytes + cluster_size - 1) / cluster_size;
+		if(!inMapping(vol, index, loc, (size_t)count * cluster_size)
+				|| verifyClusters(vol->map + loc, index, count, cluster_size)
+				!= 0)
+			return false;
+		return writeFully(out_fd, vol->map + loc, bytes);
+	}
+	
+	while(bytes != 0 && sums.table == NULL){
+		sent = sendfile(out_fd, vol->fd, &loc, bytes);
+		if(sent > 0){
+			bytes -= sent;
+			continue;
+		}
+		if(sent < 0 && errno == EINTR)
+			continue;
+		if(sent < 0 && (errno == EINVAL || errno == ENOSYS))
+			break;
+		return false;
+	}
+	
+	// a mapping of the image can't reach past its end, so bad chains are 
+	// left to the buffered path
+	if(bytes != 0 && sums.table != NULL){
+		long pagesize = sysconf(_SC_PAGESIZE);
+		size_t chunk = COPY_CHUNK / cluster_size * cluster_size, len, span;
+		struct stat st;
+		if(chunk == 0)
+			chunk = cluster_size;
+		if(fstat(vol->fd, &st) != 0)
+			st.st_size = 0;
+		while(bytes != 0){
+			len = bytes < chunk ? bytes : chunk;
+			span = (len + cluster_size - 1) / cluster_size * cluster_size;
+			off_t start = loc / pagesize * pagesize;
+			if(loc + (off_t)span > st.st_size)
+				break;
+			char* map = (char*)mmap(NULL, span + (loc - start), PROT_READ, 
+				MAP_SHARED, vol->fd, start);
+			if(map == MAP_FAILED)
+				break;
+			madvise(map, span + (loc - start), MADV_SEQUENTIAL);
+			bool ok = verifyClusters(map + (loc - start), loc / cluster_size, 
+				span / cluster_size, cluster_size) == 0 
+				&& writeFully(out_fd, map + (loc - start), len);
+			munmap(map, span + (loc - start));
+			if(!ok)
+				return false;
+			loc += len;
+			bytes -= len;
+		}
+	}
+	
+	// no luck; do it the old-fashioned way, a whole number of clusters at
+	// a time
+	if(bytes != 0){
+		size_t chunk = COPY_CHUNK / cluster_size * cluster_size;
+		if(chunk == 0)
+			chunk = cluster_size;
+		char* buf = (char*)malloc(chunk);
+		while(bytes != 0){
+			
+			// sendfile() was never tried with checksums, so loc is still
+			// on a cluster boundary
+			size_t len = bytes < chunk ? bytes : chunk;
+			bool got = sums.table != NULL 
+				? readClusters(MBR, buf, loc / cluster_size, len, vol)
+				: pread(vol->fd, buf, len, loc) == (ssize_t)len;
+			if(!got || !writeFully(out_fd, buf, len)){
+				free(buf);
+				return false;
+			}
+			loc += len;
+			bytes -= len;
+		}
+		free(buf);
+	}
+	return true;
+}
+
+/*
+* Reads bytes starting at a cluster straight from the image (or mapping) 
+* with one large read, and checks them against their checksums; a partial
+* last cluster has the rest of it read in just for that.  This goes around
+* the cluster cache, so flush it first.
+*
+* @returns				false if the bytes couldn't be read, or a cluster 
+*						doesn't match its checksum
+*/
+bool readClusters(mbr* MBR, char* buf, unsigned int index, size_t bytes,
+		volume* vol){
+	
+	// vars
+	unsigned int cluster_size = MBR->cluster_size, 
+		whole = bytes / cluster_size, tail = bytes % cluster_size;
+	off_t loc = (off_t)cluster_size * index;
+	
+	if(vol->map != NULL){
+		if(!inMapping(vol, index, loc, 
+				(size_t)(whole + (tail != 0)) * cluster_size)
+				|| verifyClusters(vol->map + loc, index, whole + (tail != 0),
+				cluster_size) != 0)
+			return false;
+		memcpy(buf, vol->map + loc, bytes);
+		return true;
+	}
+	if(pread(vol->fd, buf, bytes, loc) != (ssize_t)bytes){
+		fprintf(stderr, "Whoops! Couldn't read clusters from %u!\n", index);
+		return false;
+	}
+	
+	if(verifyClusters(buf, index, whole, cluster_size) != 0)
+		return false;
+	if(tail != 0 && sums.table != NULL && sums.table[index + whole] != 0){
+		char* last = (char*)malloc(cluster_size);
+		off_t rest = loc + bytes;
+		bool ok = false;
+		memcpy(last, buf + bytes - tail, tail);
+		if(pread(vol->fd, last + tail, cluster_size - tail, rest) 
+				== (ssize_t)(cluster_size - tail))
+			ok = verifyClusters(last, index + whole, 1, cluster_size) == 0;
+		else
+			fprintf(stderr, "Whoops! Couldn't read cluster %u!\n", 
+				index + whole);
+		free(last);
+		return ok;
+	}
+	return true;
+}
+
+/*
+* Copies count adjacent clusters to another spot in the image.  The kernel
+* does the copy with copy_file_range() where it can (the mapping gets a 
+* memmove), otherwise it goes through a large buffer.  Like readClusters(),
+* this works on the image directly, so flush the cache first.
+*
+* @returns				false (after saying why) if the copy didn't all 
+*						get done
+*/
+bool copyClusters(mbr* MBR, volume* vol, unsigned int src, unsigned int dst,
+		unsigned int count){
+	
+	// vars
+	off_t src_loc = (off_t)MBR->cluster_size * src,
+		dst_loc = (off_t)MBR->cluster_size * dst;
+	size_t bytes = (size_t)count * MBR->cluster_size;
+	ssize_t r;
+	
+	if(vol->map != NULL){
+		if(!inMapping(vol, src, src_loc, bytes) 
+				|| !inMapping(vol, dst, dst_loc, bytes))
+			return false;
+		memmove(vol->map + dst_loc, vol->map + src_loc, bytes);
+		bytes = 0;
+	}
+	else{
+		for(unsigned int i = 0; i < count; i++)
+			invalidateCachedCluster(dst + i);
+	}
+	
+	while(bytes != 0){
+		r = copy_file_range(vol->fd, &src_loc, vol->fd, &dst_loc, bytes, 0);
+		if(r <= 0)
+			break;
+		bytes -= r;
+	}
+	
+	// the kernel wouldn't do it (or not all of it); do it ourselves
+	if(bytes != 0){
+		size_t chunk = bytes < COPY_CHUNK ? bytes : COPY_CHUNK;
+		char* buf = (char*)malloc(chunk);
+		while(bytes != 0){
+			size_t n = bytes < chunk ? bytes : chunk;
+			if(pread(vol->fd, buf, n, src_loc) != (ssize_t)n 
+					|| pwrite(vol->fd, buf, n, dst_loc) != (ssize_t)n){
+				fprintf(stderr, "Whoops! Couldn't copy cluster %u!\n", src);
+				break;
+			}
+			src_loc += n;
+			dst_loc += n;
+			bytes -= n;
+		}
+		free(buf);
+	}
+	
+	if(bytes != 0)
+		return false;
+	
+	// the copies have the same checksums as the originals, once they're 
+	// really there
+	if(sums.table != NULL){
+		memmove(sums.table + dst, sums.table + src, 
+			sizeof(unsigned int) * count);
+		markDirty(&sum_dirty, (size_t)dst * sizeof(unsigned int), 
+			sizeof(unsigned int) * count);
+	}
+	return true;
+}
+
+/*
+* read() until len bytes are in or the file runs out.
+*
+* @returns				how many bytes were actually read
+*/
+size_t readFully(int fd, char* buf, size_t len){
+	size_t got = 0;
+	while(got < len){
+		ssize_t r = read(fd, buf + got, len - got);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			break;
+		got += r;
+	}
+	return got;
+}
+
+/*
+* write() until everything is out or something goes wrong.
+*/
+bool writeFully(int fd, char* buf, size_t len){
+	while(len != 0){
+		ssize_t r = write(fd, buf, len);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			return false;
+		buf += r;
+		len -= r;
+	}
+	return true;
+}
+
+/*
+* Opens a disk image for the rest of the session.
+*
+* @param	fsname			path to the image on the host
+* @param	use_mmap		map the whole image into memory as well
+*
+* @returns				the open volume, or NULL if the image doesn't exist
+*/
+volume* openVolume(char* fsname, bool use_mmap){
+	
+	// vars
+	int fd = open(fsname, O_RDWR);
+	if(fd < 0)
+		return NULL;
+	
+	return attachVolume(fd, fsname, use_mmap);
+}
+
+/*
+* Creates a brand new, sparse disk image: it is sized with ftruncate, so 
+* everything but the MBR is a hole that reads back as zeroes, and creating
+* one costs the same no matter how big it is.
+*
+* @param	fsname			path to the image on the host; must not exist
+* @param	MBR				the filled-in master boot record
+* @param	use_mmap		map the whole image into memory as well
+*
+* @returns				the open volume, or NULL if it couldn't be made
+*/
+volume* createVolume(char* fsname, mbr* MBR, bool use_mmap){
+	
+	// vars
+	int fd = open(fsname, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(fd < 0)
+		return NULL;
+	
+	if(ftruncate(fd, diskSize(MBR)) != 0 
+			|| pwrite(fd, MBR, sizeof(mbr), 0) != sizeof(mbr)){
+		close(fd);
+		unlink(fsname);
+		return NULL;
+	}
+	
+	return attachVolume(fd, fsname, use_mmap);
+}
+
+/*
+* Wraps an open image descriptor up as a volume, mapping it if asked to.
+*/
+volume* attachVolume(int fd, char* fsname, bool use_mmap){
+	
+	// vars
+	struct stat st;
+	volume* vol = (volume*)malloc(sizeof(volume));
+	vol->fd = fd;
+	vol->name = fsname;
+	vol->map = NULL;
+	vol->length = 0;
+	
+	// if the image can't be mapped just fall back to plain I/O
+	if(use_mmap && fstat(fd, &st) == 0 && st.st_size > 0){
+		void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, 
+			MAP_SHARED, fd, 0);
+		if(map != MAP_FAILED){
+			vol->map = (char*)map;
+			vol->length = st.st_size;
+		}
+		else
+			cerr << "Couldn't map " << fsname << ", using normal I/O\n";
+	}
+	return vol;
+}
+
+/*
+* Sets up the in-memory directory table and FAT.  In mmap mode they point
+* straight into the mapping, otherwise they are read into fresh buffers.
+*
+* @param	vol				the open volume
+* @param	MBR				the filesystem's master boot record
+* @param	dir_table		receives the directory table
+* @param	file_table		receives the FAT
+* @param	blank			the image was just created, so both tables are
+*							known to be all zeroes and aren't read
+*/
+void loadTables(volume* vol, mbr* MBR, directory** dir_table, 
+		unsigned int** file_table, bool blank){
+	
+	// vars
+	unsigned int MAX_FILES = clusterCount(MBR);
+	off_t dir_loc = (off_t)MBR->dir_table_index * MBR->cluster_size;
+	off_t fat_loc = (off_t)MBR->FAT_index * MBR->cluster_size;
+	off_t sum_loc = (off_t)MBR->checksum_index * MBR->cluster_size;
+	size_t dir_len = sizeof(directory) * MAX_FILES,
+		fat_len = sizeof(unsigned int) * MAX_FILES,
+		sum_len = hasChecksums(MBR) ? fat_len : 0;
+	
+	// nothing differs from the disk yet
+	initDirtyMap(&dir_dirty, dir_len);
+	initDirtyMap(&fat_dirty, fat_len);
+	initDirtyMap(&sum_dirty, sum_len);
+	sums.table = NULL;
+	if(sum_len != 0)
+		initChecksums();
+	
+	// an image shorter than its MBR claims can't be mapped safely
+	if(vol->map != NULL && (dir_loc + dir_len > vol->length 
+			|| fat_loc + fat_len > vol->length
+			|| sum_loc + sum_len > vol->length)){
+		cerr << "This filesystem is smaller than its MBR says; "
+				"using normal I/O\n";
+		munmap(vol->map, vol->length);
+		vol->map = NULL;
+	}
+	
+	if(vol->map != NULL){
+		*dir_table = (directory*)(vol->map + dir_loc);
+		*file_table = (unsigned int*)(vol->map + fat_loc);
+		if(sum_len != 0)
+			sums.table = (unsigned int*)(vol->map + sum_loc);
+		return;
+	}
+	
+	// lazily loaded tables don't get read at all yet
+	if(lazy.enabled && !blank){
+		*dir_table = (directory*)mapTable(vol, dir_loc, dir_len, 
+			&lazy.dir_base, &lazy.dir_span);
+		*file_table = (unsigned int*)mapTable(vol, fat_loc, fat_len, 
+			&lazy.fat_base, &lazy.fat_span);
+		if(sum_len != 0)
+			sums.table = (unsigned int*)mapTable(vol, sum_loc, sum_len, 
+				&lazy.sum_base, &lazy.sum_span);
+		if(*dir_table != NULL && *file_table != NULL 
+				&& (sum_len == 0 || sums.table != NULL))
+			return;
+		
+		cerr << "Couldn't map the tables of " << vol->name 
+			<< ", loading them up front\n";
+		if(lazy.dir_base != NULL)
+			munmap(lazy.dir_base, lazy.dir_span);
+		if(lazy.fat_base != NULL)
+			munmap(lazy.fat_base, lazy.fat_span);
+		if(lazy.sum_base != NULL)
+			munmap(lazy.sum_base, lazy.sum_span);
+		lazy.dir_base = lazy.fat_base = lazy.sum_base = NULL;
+	}
+	
+	*dir_table = (directory*)(calloc(MAX_FILES, sizeof(directory)));
+	*file_table = (unsigned int*)(calloc(MAX_FILES, sizeof(unsigned int)));
+	if(sum_len != 0)
+		sums.table = (unsigned int*)calloc(MAX_FILES, sizeof(unsigned int));
+	if(blank)
+		return;
+	pread(vol->fd, *dir_table, dir_len, dir_loc);
+	pread(vol->fd, *file_table, fat_len, fat_loc);
+	if(sum_len != 0)
+		pread(vol->fd, sums.table, sum_len, sum_loc);
+}
+
+/*
+* Privately maps one of the tables for lazy loading.  mmap wants a page
+* aligned offset, so the mapping may start a little before the table.
+*
+* @param	loc				where the table starts on the disk
+* @param	len				size of the table, in bytes
+* @param	base			receives the start of the mapping
+* @param	span			receives the length of the mapping
+*
+* @returns				the table, or NULL if it couldn't be mapped
+*/
+char* mapTable(volume* vol, off_t loc, size_t len, char** base, 
+		size_t* span){
+	
+	// vars
+	struct stat st;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	off_t start = loc / pagesize * pagesize;
+	
+	// touching a page past the end of the image would be fatal
+	*base = NULL;
+	if(fstat(vol->fd, &st) != 0 || st.st_size < loc + (off_t)len)
+		return NULL;
+	
+	void* map = mmap(NULL, len + (loc - start), PROT_READ | PROT_WRITE, 
+		MAP_PRIVATE, vol->fd, start);
+	if(map == MAP_FAILED)
+		return NULL;
+	*base = (char*)map;
+	*span = len + (loc - start);
+	return *base + (loc - start);
+}
+
+/*
+* Builds the free map, directory index and reference counts if a lazy mount
+* put that off; every command that changes the volume calls this first.
+*/
+void ensureTables(mbr* MBR, directory* dir_table, unsigned int* file_table,
+		volume* vol){
+	if(lazy.scanned)
+		return;
+	buildFreeMap(MBR, file_table);
+	ensureIndex(MBR, dir_table);
+	buildRefCounts(MBR, dir_table, file_table, vol);
+	lazy.scanned = true;
+	
+	// the scans pulled in every page; most of them can go again
+	trimTables(MBR);
+}
+
+/*
+* Builds just the directory index if a lazy mount put that off, for commands
+* that only read: finding files needs neither the FAT scan behind the free 
+* map nor the walk of every subdirectory behind the reference counts.
+*/
+void ensureIndex(mbr* MBR, directory* dir_table){
+	if(lazy.indexed)
+		return;
+	buildDirectoryIndex(MBR, dir_table);
+	lazy.indexed = true;
+	trimTables(MBR);
+}
+
+/*
+* Drops clean table pages once more of the lazily loaded tables are resident
+* than the budget allows.  They get read back in from the image if they're 
+* touched again; pages whose changes haven't been written home yet stay.
+*/
+void trimTables(mbr* MBR){
+	
+	// vars
+	unsigned int MAX_FILES = clusterCount(MBR);
+	long pagesize = sysconf(_SC_PAGESIZE);
+	size_t resident = 0, pages;
+	
+	if(!lazy.enabled || lazy.dir_base == NULL)
+		return;
+	
+	// count what's in memory right now
+	char* bases[] = {lazy.fat_base, lazy.dir_base, lazy.sum_base};
+	size_t spans[] = {lazy.fat_span, lazy.dir_span, lazy.sum_span};
+	for(int t = 0; t < 3; t++){
+		if(bases[t] == NULL)
+			continue;
+		pages = (spans[t] + pagesize - 1) / pagesize;
+		unsigned char* in_core = (unsigned char*)malloc(pages);
+		if(mincore(bases[t], spans[t], in_core) == 0)
+			for(size_t p = 0; p < pages; p++)
+				resident += (in_core[p] & 1) * pagesize;
+		free(in_core);
+	}
+	if(resident <= lazy.budget)
+		return;
+	
+	lazy.trims++;
+	trimMapping(lazy.fat_base, lazy.fat_span, 
+		lazy.fat_span - sizeof(unsigned int) * MAX_FILES, 
+		sizeof(unsigned int) * MAX_FILES, &fat_dirty);
+	trimMapping(lazy.dir_base, lazy.dir_span, 
+		lazy.dir_span - sizeof(directory) * MAX_FILES, 
+		sizeof(directory) * MAX_FILES, &dir_dirty);
+	if(lazy.sum_base != NULL)
+		trimMapping(lazy.sum_base, lazy.sum_span, 
+			lazy.sum_span - sizeof(unsigned int) * MAX_FILES, 
+			sizeof(unsigned int) * MAX_FILES, &sum_dirty);
+}
+
+/*
+* Drops every run of pages in a table mapping that holds nothing the disk
+* doesn't already have.
+*
+* @param	base			start of the mapping
+* @param	span			length of the mapping
+* @param	slack			how far into the mapping the table starts
+* @param	table_len		size of the table, in bytes
+* @param	dirty			the table's dirty pages
+*/
+void trimMapping(char* base, size_t span, size_t slack, size_t table_len,
+		dirtymap* dirty){
+	
+	// vars
+	long pagesize = sysconf(_SC_PAGESIZE);
+	size_t pages = (span + pagesize - 1) / pagesize, run = 0;
+	
+	for(size_t p = 0; p <= pages; p++){
+		
+		// a page is clean if every dirty-map page it overlaps is
+		bool clean = p < pages;
+		if(clean){
+			size_t first = p * pagesize < slack ? 0 : p * pagesize - slack,
+				last = (p + 1) * pagesize - slack;
+			if(last > table_len)
+				last = table_len;
+			for(size_t d = first / DIRTY_PAGE; clean && last > first 
+					&& d <= (last - 1) / DIRTY_PAGE; d++)
+				clean = dirty->pages[d] == 0;
+		}
+		
+		if(clean){
+			run++;
+			continue;
+		}
+		if(run != 0){
+			char* start = base + (p - run) * pagesize;
+			size_t len = run * pagesize;
+			if(start + len > base + span)
+				len = base + span - start;
+			madvise(start, len, MADV_DONTNEED);
+			lazy.dropped += run;
+		}
+		run = 0;
+	}
+}
+
+/*
+* Commit point: forces everything written so far out to the disk.
+*/
+void syncVolume(volume* vol){
+	flushClusterCache(vol);
+	if(vol->map != NULL && msync(vol->map, vol->length, MS_SYNC) != 0)
+		fprintf(stderr, "Whoops! Couldn't sync %s!\n", vol->name);
+	else if(vol->map == NULL && fdatasync(vol->fd) != 0)
+		fprintf(stderr, "Whoops! Couldn't sync %s!\n", vol->name);
+}
+
+/*
+* Sets up an empty cluster cache holding as many clusters as fit in budget
+* bytes.
+*/
+void initClusterCache(unsigned int budget, unsigned int cluster_size){
+	
+	// vars
+	unsigned int buckets = 1;
+	
+	cache.capacity = budget / cluster_size;
+	cache.cluster_size = cluster_size;
+	if(cache.capacity == 0)
+		return;
+	
+	while(buckets < cache.capacity)
+		buckets <<= 1;
+	cache.buckets = (cache_entry**)calloc(buckets, sizeof(cache_entry*));
+	cache.mask = buckets - 1;
+}
+
+/*
+* Returns the cache entry for a cluster, or NULL if it isn't cached.
+*/
+cache_entry* findCachedCluster(unsigned int index){
+	cache_entry* entry = cache.buckets[index & cache.mask];
+	while(entry != NULL && entry->index != index)
+		entry = entry->hnext;
+	return entry;
+}
+
+/*
+* Moves an entry to the most recently used end of the LRU list.
+*/
+void touchCacheEntry(cache_entry* entry){
+	if(cache.head == entry)
+		return;
+	
+	// unlink it (it can't be the head, so prev is set)
+	entry->prev->next = entry->next;
+	if(entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		cache.tail = entry->prev;
+	
+	// and put it back at the front
+	entry->prev = NULL;
+	entry->next = cache.head;
+	cache.head->prev = entry;
+	cache.head = entry;
+}
+
+/*
+* Unhooks an entry from both the LRU list and its hash chain.
+*/
+void unlinkCacheEntry(cache_entry* entry){
+	cache_entry** link = &cache.buckets[entry->index & cache.mask];
+	while(*link != entry)
+		link = &(*link)->hnext;
+	*link = entry->hnext;
+	
+	if(entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		cache.head = entry->next;
+	if(entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		cache.tail = entry->prev;
+	cache.count--;
+}
+
+/*
+* Finds or creates the cache entry for a cluster, making it the most recently
+* used one.  When the cache is full the least recently used cluster is 
+* evicted (and written back first if it was dirty).
+*
+* @param	vol				the open volume
+* @param	index			the cluster wanted
+* @param	load			fill a new entry from disk; not needed when the 
+*							caller is about to overwrite the whole cluster
+*
+* @returns				the entry, or NULL (after saying why) if the 
+*						cluster couldn't be loaded or failed its checksum;
+*						a bad copy is never kept
+*/
+cache_entry* cacheCluster(volume* vol, unsigned int index, bool load){
+	
+	// vars
+	cache_entry* entry = findCachedCluster(index);
+	off_t loc = (off_t)cache.cluster_size * index;
+	
+	if(entry != NULL){
+		cache.hits++;
+		touchCacheEntry(entry);
+		return entry;
+	}
+	cache.misses++;
+	
+	// reuse the oldest entry's memory if we're out of room; one that can't
+	// be written back is the only copy of its cluster, so it stays (dirty)
+	// and the cache runs over capacity instead
+	if(cache.count >= cache.capacity){
+		entry = cache.tail;
+		if(entry->dirty){
+			if(pwrite(vol->fd, entry->data, cache.cluster_size, 
+					(off_t)cache.cluster_size * entry->index) 
+					!= cache.cluster_size){
+				fprintf(stderr, "Whoops! Couldn't write back cluster %u!\n",
+					entry->index);
+				entry = NULL;
+			}
+			else{
+				entry->dirty = false;
+				cache.writebacks++;
+			}
+		}
+		if(entry != NULL){
+			unlinkCacheEntry(entry);
+			cache.evictions++;
+		}
+	}
+	if(entry == NULL){
+		entry = (cache_entry*)malloc(sizeof(cache_entry));
+		entry->data = (char*)malloc(cache.cluster_size);
+	}
+	
+	entry->index = index;
+	entry->dirty = false;
+	if(load && pread(vol->fd, entry->data, cache.cluster_size, loc) 
+			!= cache.cluster_size){
+		fprintf(stderr, "Whoops! Couldn't read cluster %u!\n", index);
+		free(entry->data);
+		free(entry);
+		return NULL;
+	}
+	if(load && verifyClusters(entry->data, index, 1, cache.cluster_size)){
+		free(entry->data);
+		free(entry);
+		return NULL;
+	}
+	
+	// link it in at the front of the LRU list and into its hash chain
+	entry->hnext = cache.buckets[index & cache.mask];
+	cache.buckets[index & cache.mask] = entry;
+	entry->prev = NULL;
+	entry->next = cache.head;
+	if(cache.head != NULL)
+		cache.head->prev = entry;
+	cache.head = entry;
+	if(cache.tail == NULL)
+		cache.tail = entry;
+	cache.count++;
+	
+	return entry;
+}
+
+/*
+* Drops a cluster from the cache without writing it back; for when the disk
+* copy has just been replaced behind the cache's back.
+*/
+void invalidateCachedCluster(unsigned int index){
+	if(cache.capacity == 0)
+		return;
+	
+	cache_entry* entry = findCachedCluster(index);
+	if(entry != NULL){
+		unlinkCacheEntry(entry);
+		free(entry->data);
+		free(entry);
+	}
+}
+
+int compareCacheEntries(const void* a, const void* b){
+	unsigned int x = (*(cache_entry**)a)->index, 
+		y = (*(cache_entry**)b)->index;
+	return x < y ? -1 : x > y;
+}
+
+/*
+* Writes every dirty cluster back to the disk in cluster order, handing each
+* run of adjacent clusters to a single pwritev.
+*/
+void flushClusterCache(volume* vol){
+	
+	// vars
+	cache_entry** dirty;
+	unsigned int count = 0, i, run;
+	struct iovec iov[IOV_MAX];
+	
+	if(cache.capacity == 0)
+		return;
+	
+	dirty = (cache_entry**)malloc(sizeof(cache_entry*) * cache.count);
+	for(cache_entry* entry = cache.head; entry != NULL; entry = entry->next)
+		if(entry->dirty)
+			dirty[count++] = entry;
+	qsort(dirty, count, sizeof(cache_entry*), compareCacheEntries);
+	
+	for(i = 0; i < count; i += run){
+		for(run = 0; i + run < count && run < IOV_MAX 
+				&& dirty[i + run]->index == dirty[i]->index + run; run++){
+			iov[run].iov_base = dirty[i + run]->data;
+			iov[run].iov_len = cache.cluster_size;
+			dirty[i + run]->dirty = false;
+		}
+		if(pwritev(vol->fd, iov, run, (off_t)cache.cluster_size * 
+				dirty[i]->index) != (ssize_t)run * cache.cluster_size){
+			fprintf(stderr, "Whoops! Couldn't write back cluster %u!\n", 
+				dirty[i]->index);
+			for(unsigned int k = 0; k < run; k++)
+				dirty[i + k]->dirty = true;
+			continue;
+		}
+		cache.writebacks += run;
+	}
+	free(dirty);
+}
+
+/*
+* Syncs and releases a volume at the end of the session.
+*/
+void closeVolume(volume* vol){
+	if(vol == NULL)
+		return;
+	collectHoles(true);
+	syncVolume(vol);
+	if(vol->map != NULL)
+		munmap(vol->map, vol->length);
+	close(vol->fd);
+	free(vol);
+}
+
+/*
+* Returns the size of a given file
+* Source: 7
+*/
+off_t fsize(const char *filename) {
+    struct stat st; 
+
+    if (stat(filename, &st) == 0)
+        return st.st_size;
+
+    return -1; 
+}
+
+
+/*
+* Looks up a file by its exact name through the directory index.
+*
+* @returns				the file's slot in the directory table, or MAX_FILES
+*						if there is no such file
+*/
+unsigned int findDirectoryIndexOfFile(directory* files, char* filename){
+
+	// vars
+	unsigned int bucket = hashFileName(filename) & dir_hash_mask;
+
+	while(dir_hash[bucket] != EMPTY_SLOT){
+		if(strncmp(files[dir_hash[bucket]].name, filename, 
+				sizeof(files[0].name)) == 0)
+			return dir_hash[bucket];
+		bucket = (bucket + 1) & dir_hash_mask;
+	}
+	
+	return MAX_FILES;
+}
+
+void deleteFile(directory* files, unsigned int* file_table, int index){
+	
+	// mark the file deleted
+	unindexDirectoryEntry(files, index);
+	files[index].name[0] = 0xFF;
+	markDirectoryEntryDirty(index);
+}
+
+/*
+* FNV-1a hash of a file name, never looking past the end of the name field.
+*/
+unsigned int hashFileName(const char* name){
+	unsigned int hash = 2166136261u;
+	for(unsigned int i = 0; i < sizeof(((directory*)0)->name) && name[i]; 
+			i++){
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+* Builds the name -> slot index over the whole directory table.  The table
+* is kept at most half full so probe sequences stay short.
+*
+* @param	MBR				the filesystem's master boot record
+* @param	dir_table		the in-memory directory table
+*/
+void buildDirectoryIndex(mbr* MBR, directory* dir_table){
+	
+	// vars
+	unsigned int MAX_FILES = clusterCount(MBR),
+		buckets = 1;
+	
+	while(buckets < MAX_FILES * 2)
+		buckets <<= 1;
+	
+	free(dir_hash);
+	dir_hash = (unsigned int*)malloc(sizeof(unsigned int) * buckets);
+	memset(dir_hash, 0xFF, sizeof(unsigned int) * buckets);
+	dir_hash_mask = buckets - 1;
+	
+	for(unsigned int i = 0; i < MAX_FILES; i++){
+		if(dir_table[i].name[0] != 0x00 
+				&& (unsigned char)dir_table[i].name[0] != DELETED_FILE)
+			indexDirectoryEntry(dir_table, i);
+	}
+}
+
+/*
+* Adds a directory slot to the index; the slot's name must already be set.
+*/
+void indexDirectoryEntry(directory* dir_table, unsigned int index){
+	unsigned int bucket = hashFileName(dir_table[index].name) 
+		& dir_hash_mask;
+	
+	while(dir_hash[bucket] != EMPTY_SLOT)
+		bucket = (bucket + 1) & dir_hash_mask;
+	dir_hash[bucket] = index;
+}
+
+/*
+* Removes a directory slot from the index, before its name is wiped.  Later
+* members of the probe run are shifted back so no tombstones are needed.
+*/
+void unindexDirectoryEntry(directory* dir_table, unsigned int index){
+	
+	// vars
+	unsigned int hole = hashFileName(dir_table[index].name) & dir_hash_mask,
+		next, home;
+	
+	while(dir_hash[hole] != index){
+		if(dir_hash[hole] == EMPTY_SLOT)
+			return;
+		hole = (hole + 1) & dir_hash_mask;
+	}
+	
+	// pull back anything that could no longer be reached past the hole
+	next = hole;
+	while(true){
+		next = (next + 1) & dir_hash_mask;
+		if(dir_hash[next] == EMPTY_SLOT)
+			break;
+		home = hashFileName(dir_table[dir_hash[next]].name) & dir_hash_mask;
+		if(((next - home) & dir_hash_mask) >= ((next - hole) & dir_hash_mask)){
+			dir_hash[hole] = dir_hash[next];
+			hole = next;
+		}
+	}
+	dir_hash[hole] = EMPTY_SLOT;
+}
+
+/*
+* Just prints that a process we had forked and ran in the background finished 
+* running and has exited.
+*
+* @param	childPID		the process ID of the process that just exit
+*/
+void processTerminated(int childPID){
+	
+	// don't print termination messages if the process didn't come from a 
+	// forked background process
+	if(childPID > 0)
+		cout << "Child Process terminated: " << childPID << endl;
+}
+
+int checkFSIntegrity(mbr * MBR){
+	
+	int problemsFound = 0;
+	
+	if(MBR->cluster_size < 8 * KILOBYTE){
+		cerr << "Looks like this filesystem's cluster size is really " 
+				"small!\n This could cause problems with reading/writing "
+				"files.\n";
+		problemsFound++;
+	}
+	else if(MBR->cluster_size > 16 * KILOBYTE){
+		cerr << "This filesystem uses an abnormally large cluster size;\n"
+				"this shouldn't cause problems, however.\n";
+		problemsFound++;
+	}
+	
+	if(diskSize(MBR) < 5 * MEGABYTE){
+		cerr << "Warning! This filesystem is unusually small! This is not "
+				"necessarily a problem, but should be made bigger.\n";
+		problemsFound++;
+	}
+	else if(!isFormatV2(MBR) && MBR->disk_size > 50 * MEGABYTE){
+		cerr << "This filesystem is abnormally large in size;\n"
+				"this shouldn't cause problems, however.\n";
+		problemsFound++;
+	}
+	
+	if(MBR->FAT_index < 1){
+		cerr << "The filesystem's FAT appears to be in a non-standard"
+				" location!\n";
+		problemsFound++;
+	}
+	if(MBR->dir_table_index < 1){
+		cerr << "The filesystem's directory table appears to be in a"
+				"non-standard location!\n";
+		problemsFound++;
+	}
+	
+	if(MBR->dir_table_index == MBR->FAT_index){
+		cerr << "The filesystem's FAT and directory table appear to be"
+				" in the same location!\n";
+		problemsFound++;
+	}
+	
+	if(hasChecksums(MBR) && (MBR->checksum_index < MBR->FAT_index 
+			|| MBR->checksum_index >= clusterCount(MBR))){
+		cerr << "The filesystem's checksum table appears to be in a"
+				" non-standard location!\n";
+		problemsFound++;
+	}
+	
+	return problemsFound;
+}
+
+/*
+* Resets all characters of a given char array to nul-bytes
+*
+* @param	buf				character array to be cleaned up
+*/
+void resetBuf(char* buf){
+	memset(buf, 0, strlen(buf));
+}
+
+void updateFileTable(volume* vol, mbr* MBR, unsigned int* file_table){
+	
+	// vars
+	off_t fat_loc = (off_t)MBR->FAT_index * MBR->cluster_size;
+	unsigned int MAX_FILES = clusterCount(MBR);
+	
+	// write the modified parts of the FAT to the disk
+	flushDirtyPages(vol, &fat_dirty, (char*)file_table, 
+		sizeof(unsigned int) * MAX_FILES, fat_loc);
+}
+
+void updateDirectoryTable(volume* vol, mbr* MBR, directory* dir_table){
+
+	// vars
+	off_t dir_loc = (off_t)MBR->dir_table_index * MBR->cluster_size;
+	unsigned int MAX_FILES = clusterCount(MBR);
+	
+	// write the modified parts of the directory table to the disk
+	flushDirtyPages(vol, &dir_dirty, (char*)dir_table, 
+		sizeof(directory) * MAX_FILES, dir_loc);
+}
+
+void updateChecksumTable(volume* vol, mbr* MBR){
+	
+	// vars
+	off_t sum_loc = (off_t)MBR->checksum_index * MBR->cluster_size;
+	unsigned int MAX_FILES = clusterCount(MBR);
+	
+	// write the modified parts of the checksum table to the disk
+	if(sums.table != NULL)
+		flushDirtyPages(vol, &sum_dirty, (char*)sums.table, 
+			sizeof(unsigned int) * MAX_FILES, sum_loc);
+}
+
+/*
+* Starts tracking a table of the given length with every page clean.
+*/
+void initDirtyMap(dirtymap* dirty, size_t table_len){
+	free(dirty->pages);
+	dirty->count = (table_len + DIRTY_PAGE - 1) / DIRTY_PAGE;
+	dirty->pages = (unsigned char*)calloc(dirty->count, 1);
+}
+
+/*
+* Records that a byte range of a table has changed in memory.
+*/
+void markDirty(dirtymap* dirty, size_t offset, size_t length){
+	for(size_t page = offset / DIRTY_PAGE; 
+			page <= (offset + length - 1) / DIRTY_PAGE 
+			&& page < dirty->count; page++)
+		dirty->pages[page] |= PAGE_DIRTY;
+}
+
+void markDirectoryEntryDirty(unsigned int index){
+	markDirty(&dir_dirty, (size_t)index * sizeof(directory), 
+		sizeof(directory));
+}
+
+/*
+* Writes each run of dirty (or logged) pages back with one positioned write
+* and marks them clean.  Mapped tables already live in the image, so there the runs
+* are only handed to msync.
+*
+* @param	vol				the open volume
+* @param	dirty			the table's dirty pages
+* @param	table			the table in memory
+* @param	table_len		size of the table, in bytes
+* @param	loc				where the table starts on the disk
+*/
+void flushDirtyPages(volume* vol, dirtymap* dirty, char* table, 
+		size_t table_len, off_t loc){
+	
+	// vars
+	unsigned int page = 0, end;
+	size_t start_byte, len;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	
+	dirty->flushes++;
+	while(page < dirty->count){
+		if(!dirty->pages[page]){
+			page++;
+			continue;
+		}
+		
+		// find the end of this run and clean it
+		for(end = page; end < dirty->count && dirty->pages[end]; end++)
+			dirty->pages[end] = 0;
+		
+		start_byte = (size_t)page * DIRTY_PAGE;
+		len = (size_t)end * DIRTY_PAGE;
+		if(len > table_len)
+			len = table_len;
+		len -= start_byte;
+		
+		if(vol->map != NULL){
+			
+			// msync wants a page aligned address
+			char* addr = table + start_byte;
+			size_t slack = (size_t)addr % pagesize;
+			msync(addr - slack, len + slack, MS_ASYNC);
+		}
+		else if(pwrite(vol->fd, table + start_byte, len, loc + start_byte)
+				!= (ssize_t)len)
+			fprintf(stderr, "Whoops! Couldn't write back a table!\n");
+		
+		dirty->writes++;
+		dirty->bytes += len;
+		page = end;
+	}
+}
+
+/*
+* Prints how much metadata writing the volume has done this session, next to
+* what rewriting both tables in full every time would have cost.
+*/
+void printVolumeStats(mbr* MBR){
+	
+	// vars
+	unsigned int MAX_FILES;
+	
+	if(MBR == 0){
+		fprintf(stderr, "Sorry, there's no volume mounted to show stats "
+			"for!\n");
+		return;
+	}
+	MAX_FILES = clusterCount(MBR);
+	
+	cout << "FAT writeback: " << fat_dirty.flushes << " flushes, " 
+		<< fat_dirty.writes << " writes, " << fat_dirty.bytes 
+		<< "B (full rewrites: " 
+		<< fat_dirty.flushes * MAX_FILES * sizeof(unsigned int) << "B)" 
+		<< endl;
+	cout << "Directory writeback: " << dir_dirty.flushes << " flushes, " 
+		<< dir_dirty.writes << " writes, " << dir_dirty.bytes 
+		<< "B (full rewrites: " 
+		<< dir_dirty.flushes * MAX_FILES * sizeof(directory) << "B)" << endl;
+	cout << "Cluster cache: " << cache.count << " of " << cache.capacity
+		<< " clusters, " << cache.hits << " hits, " << cache.misses 
+		<< " misses, " << cache.evictions << " evictions, " 
+		<< cache.writebacks << " written back" << endl;
+	if(lazy.dir_base != NULL)
+		cout << "Tables: loaded on demand, " << lazy.budget / KILOBYTE 
+			<< "KB budget, " << lazy.trims << " trims, " << lazy.dropped 
+			<< " pages dropped" << endl;
+	if(sums.table != NULL)
+		cout << "Checksums: CRC32C (" << (sums.hardware ? "SSE4.2" 
+			: "software") << "), " << sums.verified << " clusters verified, "
+			<< sums.failed << " failed" << endl;
+	else
+		cout << "Checksums: none on this volume" << endl;
+	if(wal.length != 0)
+		cout << "Journal: " << wal.commits << " commits, " << wal.bytes 
+			<< "B logged, " << wal.checkpoints << " checkpoints, " 
+			<< wal.head << " of " << wal.length << "B in use" << endl;
+	else
+		cout << "Journal: none, tables are written through" << endl;
+	
+	pthread_mutex_lock(&holes.lock);
+	cout << "Reclaim: " << holes.freed << " clusters freed, " 
+		<< holes.waiting << " waiting";
+	if(holes.punch || holes.punched != 0 || holes.failed != 0)
+		cout << ", " << holes.punched << " punched, " << holes.failed 
+			<< " couldn't be punched";
+	cout << endl;
+	pthread_mutex_unlock(&holes.lock);
+}
+
+/*
+* Commit point for a command: makes its data and table changes durable.  With
+* a journal that's one append and one sync, and the tables are written home
+* once the journal starts filling up; without one the dirty pages go straight
+* home.  A change that doesn't fit behind what's already logged gets the 
+* journal emptied for it first.  One too big for the whole journal goes home
+* too (no more atomically than it did before there was a journal), except
+* in a script, which promised all or nothing and so is abandoned instead.
+* Changed subdirectory clusters go with the tables.
+*/
+void commitTables(volume* vol, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table){
+	
+	// vars
+	bool logged;
+	
+	flushClusterCache(vol);
+	if(wal.length != 0){
+		
+		// the tables in memory hold this change already, so room has to be 
+		// made from the journal's own copies
+		logged = logDirtyPages(vol, MBR, dir_table, file_table);
+		if(!logged && wal.head != 0){
+			drainJournal(vol, MBR);
+			logged = logDirtyPages(vol, MBR, dir_table, file_table);
+		}
+		if(logged){
+			flushDirectoryBlocks(MBR, vol);
+			if(wal.head > wal.length / 2)
+				checkpointJournal(vol, MBR, dir_table, file_table);
+			commitHolds(vol, MBR);
+			trimTables(MBR);
+			return;
+		}
+		
+		// nothing of the script has gone home yet, and the clusters it 
+		// freed are still held, so the volume is left as of the last sync
+		if(batch_mode){
+			fprintf(stderr, "Sorry, the script changed more than the journal"
+				" can commit at once; nothing since its last sync was saved!"
+				" Add sync commands to split it up!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	flushDirectoryBlocks(MBR, vol);
+	updateFileTable(vol, MBR, file_table);
+	updateDirectoryTable(vol, MBR, dir_table);
+	updateChecksumTable(vol, MBR);
+	syncVolume(vol);
+	commitHolds(vol, MBR);
+	trimTables(MBR);
+}
+
+/*
+* Called by every command that changes the volume.  Outside of a script that
+* is its commit point; inside one the changes wait for the next sync.
+*/
+void commitCommand(volume* vol, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table){
+	if(!batch_mode)
+		commitTables(vol, MBR, dir_table, file_table);
+}
+
+/*
+* Runs every line of a script as one transaction: the tables stay in memory
+* and are only committed at explicit sync commands and at the end.  Blank
+* lines and lines starting with # are skipped.
+*
+* @param	script			where the commands come from
+* @param	fsname			name of the loaded filesystem
+*/
+void runBatch(FILE* script, char* fsname, mbr* MBR, directory* files, 
+		unsigned int* file_table, volume* filesystem){
+	
+	// vars
+	char* line = NULL;
+	size_t cap = 0;
+	unsigned long commands = 0;
+	struct timeval start, end;
+	double elapsed;
+	
+	gettimeofday(&start, NULL);
+	if(wal.length == 0)
+		fprintf(stderr, "Note: %s has no journal to use here, so a crash "
+			"while the script commits can leave it half changed\n", fsname);
+	batch_mode = true;
+	while(getline(&line, &cap, script) != -1){
+		trim(line);
+		if(line[0] == '\0' || line[0] == '#')
+			continue;
+		runCommand(line, fsname, MBR, files, file_table, filesystem);
+		fflush(stdout);
+		commands++;
+	}
+	free(line);
+	
+	// one commit for whatever is left, and leave the journal empty
+	commitTables(filesystem, MBR, files, file_table);
+	batch_mode = false;
+	checkpointJournal(filesystem, MBR, files, file_table);
+	batch_commits++;
+	gettimeofday(&end, NULL);
+	
+	elapsed = (end.tv_sec - start.tv_sec) 
+		+ (end.tv_usec - start.tv_usec) / 1000000.0;
+	fprintf(stderr, "Ran %lu commands in %.3fs (%.0f commands/s), "
+		"%lu commit(s)\n", commands, elapsed, 
+		elapsed > 0 ? commands / elapsed : 0.0, batch_commits);
+}
+
+/*
+* Decides whether a command line is one of the shell's own commands on the
+* volume, which an attached shell hands to its server, rather than one for
+* the host.
+*/
+bool isVolumeCommand(char* line, char* fsname){
+	
+	// vars
+	const char* commands[] = {"ls", "cat", "cp", "touch", "rm", "mkdir", 
+		"df", "fsck", "defrag"};
+	char copy[strlen(line) + 1];
+	char* token;
+	bool known = false;
+	
+	strcpy(copy, line);
+	token = strtok(copy, " \n");
+	if(token == NULL)
+		return false;
+	if(strcmp(token, "stats") == 0 || strcmp(token, "sync") == 0)
+		return true;
+	for(unsigned int i = 0; i < sizeof(commands) / sizeof(char*); i++)
+		known = known || strcmp(token, commands[i]) == 0;
+	if(!known)
+		return false;
+	
+	while((token = strtok(NULL, " \n")) != NULL)
+		if(inVirtualFileSystem(token, fsname))
+			return true;
+	return false;
+}
+
+/*
+* Owns the volume for other shells: they attach to a Unix socket and send 
+* their volume commands, which run here one at a time against the one set 
+* of tables, cache and allocator.  Each command comes with the client's 
+* stdout, stderr and working directory, so its output (cat's sendfile() or
+* mapped writes included) goes straight to the client and host paths mean 
+* what the client meant.  Since the commands take turns, a client that 
+* stops reading its output would hold everyone up; after SERVER_STALL 
+* seconds of that, the rest of its command's output is thrown away.
+*
+* @param	path			where to put the socket; one left behind by a 
+*							server that's gone is taken over
+*/
+void serveVolume(char* path, char* fsname, mbr* MBR, directory* files, 
+		unsigned int* file_table, volume* filesystem){
+	
+	// vars
+	struct sockaddr_un addr;
+	struct pollfd fds[SERVER_CLIENTS + 1];
+	struct sigaction stop, ignore, watch;
+	unsigned int clients = 0;
+	int listener, probe, client, home = open(".", O_RDONLY | O_DIRECTORY);
+	
+	if(strlen(path) >= sizeof(addr.sun_path)){
+		fprintf(stderr, "Sorry, %s is too long for a socket name!\n", path);
+		return;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	
+	// only one server per socket
+	probe = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if(connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0){
+		fprintf(stderr, "Sorry, there's already a server on %s!\n", path);
+		close(probe);
+		return;
+	}
+	close(probe);
+	unlink(path);
+	
+	listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr))
+			!= 0 || listen(listener, SERVER_CLIENTS) != 0){
+		fprintf(stderr, "Sorry, couldn't listen on %s!\n", path);
+		if(listener >= 0)
+			close(listener);
+		return;
+	}
+	
+	// a client that goes away mid-command mustn't take the server with it
+	stop.sa_handler = stopServer;
+	stop.sa_flags = 0;
+	sigemptyset(&stop.sa_mask);
+	sigaction(SIGINT, &stop, NULL);
+	sigaction(SIGTERM, &stop, NULL);
+	ignore.sa_handler = SIG_IGN;
+	ignore.sa_flags = 0;
+	sigemptyset(&ignore.sa_mask);
+	sigaction(SIGPIPE, &ignore, NULL);
+	watch.sa_handler = watchOutput;
+	watch.sa_flags = SA_RESTART;
+	sigemptyset(&watch.sa_mask);
+	sigaction(SIGALRM, &watch, NULL);
+	server_sink = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	server_thread = pthread_self();
+	server_stop = 0;
+	serving = true;
+	fprintf(stderr, "Serving %s on %s\n", fsname, path);
+	
+	fds[0].fd = listener;
+	fds[0].events = POLLIN;
+	while(!server_stop){
+		if(poll(fds, clients + 1, -1) < 0)
+			continue;
+		
+		// new clients are told the filesystem's name, so they can tell its
+		// paths from the host's
+		if(fds[0].revents & POLLIN){
+			client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+			if(client >= 0 && clients < SERVER_CLIENTS 
+					&& send(client, fsname, strlen(fsname) + 1, 
+					MSG_NOSIGNAL) > 0){
+				clients++;
+				fds[clients].fd = client;
+				fds[clients].events = POLLIN;
+				fds[clients].revents = 0;
+			}
+			else if(client >= 0)
+				close(client);
+		}
+		
+		// one command from each client with one waiting, in turn
+		for(unsigned int k = 1; k <= clients && !server_stop; k++){
+			if(fds[k].revents == 0)
+				continue;
+			if(!(fds[k].revents & POLLIN) || !serveRequest(fds[k].fd, home, 
+					fsname, MBR, files, file_table, filesystem)){
+				close(fds[k].fd);
+				fds[k--] = fds[clients--];
+			}
+		}
+	}
+	
+	for(unsigned int k = 1; k <= clients; k++)
+		close(fds[k].fd);
+	close(listener);
+	unlink(path);
+	close(home);
+	close(server_sink);
+	serving = false;
+}
+
+/*
+* Runs one command from a client, with the client's output and working 
+* directory standing in for the server's while it runs, and then tells the
+* client it's done.
+*
+* @param	home			the server's own working directory, to go back to
+*
+* @returns				false if the client has gone, or didn't send a 
+*						proper request
+*/
+bool serveRequest(int client, int home, char* fsname, mbr* MBR, 
+		directory* files, unsigned int* file_table, volume* filesystem){
+	
+	// vars
+	char line[SERVER_MSG];
+	char control[CMSG_SPACE(sizeof(int) * 3)];
+	int fds[3] = {-1, -1, -1}, saved_out, saved_err;
+	struct itimerval tick = {{1, 0}, {1, 0}}, off;
+	struct sigaction watch;
+	struct iovec iov = {line, SERVER_MSG - 1};
+	struct msghdr msg;
+	struct cmsghdr* cmsg;
+	ssize_t n;
+	
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	n = recvmsg(client, &msg, MSG_CMSG_CLOEXEC);
+	if(n <= 0)
+		return false;
+	line[n] = '\0';
+	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; 
+			cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+				&& cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	if(fds[0] < 0 || fds[1] < 0 || fds[2] < 0){
+		for(int k = 0; k < 3; k++)
+			if(fds[k] >= 0)
+				close(fds[k]);
+		return false;
+	}
+	
+	// borrow the client's output and working directory
+	fflush(stdout);
+	saved_out = dup(STDOUT_FILENO);
+	saved_err = dup(STDERR_FILENO);
+	dup2(fds[0], STDOUT_FILENO);
+	dup2(fds[1], STDERR_FILENO);
+	fchdir(fds[2]);
+	stall_ticks = 0;
+	setitimer(ITIMER_REAL, &tick, NULL);
+	
+	trim(line);
+	if(isVolumeCommand(line, fsname))
+		runCommand(line, fsname, MBR, files, file_table, filesystem);
+	else
+		fprintf(stderr, "Sorry, the server only runs commands on %s!\n", 
+			fsname);
+	
+	// and give them back
+	fflush(stdout);
+	memset(&off, 0, sizeof(off));
+	setitimer(ITIMER_REAL, &off, NULL);
+	dup2(saved_out, STDOUT_FILENO);
+	dup2(saved_err, STDERR_FILENO);
+	close(saved_out);
+	close(saved_err);
+	fchdir(home);
+	for(int k = 0; k < 3; k++)
+		close(fds[k]);
+	
+	// a stalled client's watch ended without restarting system calls, so
+	// put that back for the next one
+	if(stall_ticks >= (sig_atomic_t)SERVER_STALL){
+		fprintf(stderr, "Whoops! A client stopped reading, so the rest of "
+			"its output was dropped!\n");
+		watch.sa_handler = watchOutput;
+		watch.sa_flags = SA_RESTART;
+		sigemptyset(&watch.sa_mask);
+		sigaction(SIGALRM, &watch, NULL);
+	}
+	
+	return send(client, "", 1, MSG_NOSIGNAL) == 1;
+}
+
+void stopServer(int){
+	server_stop = 1;
+}
+
+/*
+* Ticks once a second while a client's command runs.  Every tick the 
+* client's output can't take more counts towards SERVER_STALL; at that 
+* point its output is pointed at the sink, and the watch stops restarting 
+* system calls so the next tick breaks the write that's stuck.
+*/
+void watchOutput(int){
+	
+	// vars
+	struct pollfd out[2] = {{STDOUT_FILENO, POLLOUT, 0}, 
+		{STDERR_FILENO, POLLOUT, 0}};
+	struct sigaction watch;
+	struct itimerval off;
+	
+	// the stuck write is the server thread's, so that's where the tick goes
+	if(!pthread_equal(pthread_self(), server_thread)){
+		pthread_kill(server_thread, SIGALRM);
+		return;
+	}
+	
+	// this is the tick that broke the write; nothing else needs breaking
+	if(stall_ticks >= (sig_atomic_t)SERVER_STALL){
+		memset(&off, 0, sizeof(off));
+		setitimer(ITIMER_REAL, &off, NULL);
+		return;
+	}
+	
+	if(poll(out, 2, 0) == 2){
+		stall_ticks = 0;
+		return;
+	}
+	if(++stall_ticks < (sig_atomic_t)SERVER_STALL)
+		return;
+	dup2(server_sink, STDOUT_FILENO);
+	dup2(server_sink, STDERR_FILENO);
+	watch.sa_handler = watchOutput;
+	watch.sa_flags = 0;
+	sigemptyset(&watch.sa_mask);
+	sigaction(SIGALRM, &watch, NULL);
+}
+
+/*
+* Attaches to a server, which answers with the name of the filesystem it's
+* serving.
+*
+* @param	fsname			receives the name
+* @param	len				how much room fsname has
+*
+* @returns				the connection, or -1 if there's no server there
+*/
+int connectServer(char* path, char* fsname, size_t len){
+	
+	// vars
+	struct sockaddr_un addr;
+	int fd;
+	ssize_t n;
+	
+	if(strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+		return -1;
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 
+			|| (n = recv(fd, fsname, len - 1, 0)) <= 0){
+		close(fd);
+		return -1;
+	}
+	fsname[n] = '\0';
+	return fd;
+}
+
+/*
+* Sends a command to the server along with our stdout, stderr and working
+* directory, and waits for it to finish.  The output comes straight from 
+* the server, nothing passes back through here.
+*
+* @returns				false if the server has gone
+*/
+bool forwardCommand(char* line){
+	
+	// vars
+	int fds[3] = {STDOUT_FILENO, STDERR_FILENO, 
+		open(".", O_RDONLY | O_DIRECTORY)};
+	char control[CMSG_SPACE(sizeof(fds))], done;
+	struct iovec iov = {line, strlen(line)};
+	struct msghdr msg;
+	struct cmsghdr* cmsg;
+	bool sent;
+	
+	if(fds[2] < 0)
+		fds[2] = open("/", O_RDONLY | O_DIRECTORY);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	
+	// anything we printed has to go out ahead of the server's output
+	cout.flush();
+	fflush(stdout);
+	sent = sendmsg(server_fd, &msg, MSG_NOSIGNAL) >= 0 
+		&& recv(server_fd, &done, 1, 0) == 1;
+	close(fds[2]);
+	return sent;
+}
+
+/*
+* Takes an advisory lock on the image.  Each shell keeps its own tables, 
+* allocator and journal head, so two of them on one image would write over
+* each other; only one may have it open, and shells that want to share it
+* go through a server.
+*
+* @returns				false (after saying why) if the image is taken
+*/
+bool lockVolume(volume* vol, char* fsname){
+	if(flock(vol->fd, LOCK_EX | LOCK_NB) == 0)
+		return true;
+	cerr << "Sorry, " << fsname << " is open in another shell! To share it,"
+		" serve it with -s and attach to the server with -a!\n";
+	return false;
+}
+
+/*
+* Sets up the journal described by the MBR and replays whatever committed
+* transactions are still in it.  Mapped tables get written back by the kernel
+* whenever it likes, which a redo log can't protect, so in mmap mode the 
+* journal is only replayed and then left alone.
+*/
+void openJournal(volume* vol, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table){
+	
+	// vars
+	unsigned int MAX_FILES = clusterCount(MBR), applied = 0,
+		limit = (DIRTY_PAGE - sizeof(journal_header)) / sizeof(unsigned int),
+		cluster_pages = (MBR->cluster_size + DIRTY_PAGE - 1) / DIRTY_PAGE;
+	size_t fat_len = sizeof(unsigned int) * MAX_FILES,
+		dir_len = sizeof(directory) * MAX_FILES, len;
+	char* block = (char*)malloc(DIRTY_PAGE);
+	journal_header* header = (journal_header*)block;
+	unsigned int* list = (unsigned int*)(block + sizeof(journal_header));
+	dirtymap* maps[] = {&fat_dirty, &dir_dirty, &sum_dirty};
+	char* tables[] = {(char*)file_table, (char*)dir_table, (char*)sums.table};
+	size_t lengths[] = {fat_len, dir_len, 
+		sums.table != NULL ? fat_len : 0};
+	
+	wal.length = 0;
+	if(MBR->magic != JOURNAL_MAGIC){
+		free(block);
+		return;
+	}
+	wal.loc = (off_t)MBR->journal_index * MBR->cluster_size;
+	wal.length = (size_t)MBR->journal_clusters * MBR->cluster_size 
+		/ DIRTY_PAGE * DIRTY_PAGE;
+	wal.head = 0;
+	wal.sequence = MBR->journal_sequence;
+	
+	// walk the transactions in order until one is missing, stale or torn
+	while(wal.head + DIRTY_PAGE <= wal.length){
+		if(pread(vol->fd, block, DIRTY_PAGE, wal.loc + wal.head) != DIRTY_PAGE
+				|| header->magic != JOURNAL_MAGIC 
+				|| header->sequence != wal.sequence || header->pages > limit)
+			break;
+		len = (size_t)(header->pages + 1) * DIRTY_PAGE;
+		if(wal.head + len > wal.length)
+			break;
+		
+		char* txn = (char*)malloc(len);
+		unsigned int sum = header->checksum;
+		pread(vol->fd, txn, len, wal.loc + wal.head);
+		((journal_header*)txn)->checksum = 0;
+		if(checksumBytes(txn, len) != sum){
+			free(txn);
+			break;
+		}
+		
+		// copy each page image back over the table it came from; the latest
+		// image of each subdirectory cluster is kept for later
+		for(unsigned int i = 0; i < header->pages; i++){
+			unsigned int tag = list[i] & JOURNAL_TAGS;
+			if(tag == JOURNAL_CLUSTER){
+				if((list[i] & ~JOURNAL_TAGS) < MAX_FILES)
+					writeDirectoryBlock(MBR, list[i] & ~JOURNAL_TAGS, 
+						txn + (size_t)(i + 1) * DIRTY_PAGE);
+				i += cluster_pages - 1;
+				continue;
+			}
+			int t = tag == JOURNAL_DIR_PAGE ? 1 
+				: tag == JOURNAL_SUM_PAGE ? 2 : 0;
+			size_t start = (size_t)(list[i] & ~JOURNAL_TAGS) * DIRTY_PAGE,
+				count;
+			if(start >= lengths[t])
+				continue;
+			count = lengths[t] - start < DIRTY_PAGE ? lengths[t] - start 
+				: DIRTY_PAGE;
+			memcpy(tables[t] + start, txn + (size_t)(i + 1) * DIRTY_PAGE, 
+				count);
+			markDirty(maps[t], start, count);
+		}
+		free(txn);
+		
+		wal.head += len;
+		wal.sequence++;
+		applied++;
+	}
+	free(block);
+	
+	// get the tables up to date on disk so the journal can start over; a
+	// cluster that has stopped being part of a directory since it was logged
+	// may hold file data by now, so its old image is dropped
+	if(applied != 0){
+		cout << "Recovered " << applied << " metadata transaction(s) from "
+			"the journal\n";
+		dropStaleDirectoryBlocks(MBR, dir_table, file_table, vol);
+		flushDirectoryBlocks(MBR, vol);
+		checkpointJournal(vol, MBR, dir_table, file_table);
+	}
+	if(vol->map != NULL)
+		wal.length = 0;
+}
+
+/*
+* Appends every page changed since the last commit to the journal as one 
+* transaction and syncs it, along with every changed subdirectory cluster.
+* The pages stay marked as logged until the next checkpoint writes them home.
+*
+* @returns				false if the transaction doesn't fit; nothing was
+*						logged, and the caller has to write the tables out
+*						itself
+*/
+bool logDirtyPages(volume* vol, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table){
+	
+	// vars
+	unsigned int MAX_FILES = clusterCount(MBR), pages = 0,
+		limit = (DIRTY_PAGE - sizeof(journal_header)) / sizeof(unsigned int),
+		cluster_pages = (MBR->cluster_size + DIRTY_PAGE - 1) / DIRTY_PAGE;
+	size_t fat_len = sizeof(unsigned int) * MAX_FILES,
+		dir_len = sizeof(directory) * MAX_FILES, len;
+	dirtymap* maps[] = {&fat_dirty, &dir_dirty, &sum_dirty};
+	char* tables[] = {(char*)file_table, (char*)dir_table, (char*)sums.table};
+	size_t lengths[] = {fat_len, dir_len, fat_len};
+	unsigned int tags[] = {0, JOURNAL_DIR_PAGE, JOURNAL_SUM_PAGE};
+	
+	for(int t = 0; t < 3; t++)
+		for(unsigned int p = 0; p < maps[t]->count; p++)
+			pages += (maps[t]->pages[p] & PAGE_DIRTY) != 0;
+	for(pending_block* block = pending_blocks; block; block = block->next)
+		pages += cluster_pages;
+	if(pages == 0)
+		return true;
+	len = (size_t)(pages + 1) * DIRTY_PAGE;
+	if(pages > limit || wal.head + len > wal.length)
+		return false;
+	
+	// build the whole transaction in memory so it goes out in one write
+	char* txn = (char*)calloc(len, 1);
+	journal_header* header = (journal_header*)txn;
+	unsigned int* list = (unsigned int*)(txn + sizeof(journal_header));
+	unsigned int i = 0;
+	
+	header->magic = JOURNAL_MAGIC;
+	header->sequence = wal.sequence;
+	header->pages = pages;
+	for(int t = 0; t < 3; t++){
+		for(unsigned int p = 0; p < maps[t]->count; p++){
+			if(!(maps[t]->pages[p] & PAGE_DIRTY))
+				continue;
+			size_t start = (size_t)p * DIRTY_PAGE;
+			memcpy(txn + (size_t)(i + 1) * DIRTY_PAGE, tables[t] + start,
+				lengths[t] - start < DIRTY_PAGE ? lengths[t] - start 
+				: DIRTY_PAGE);
+			list[i++] = p | tags[t];
+		}
+	}
+	
+	// a cluster takes up as many pages as it needs, each tagged with it
+	for(pending_block* block = pending_blocks; block; block = block->next){
+		memcpy(txn + (size_t)(i + 1) * DIRTY_PAGE, block->data, 
+			MBR->cluster_size);
+		for(unsigned int k = 0; k < cluster_pages; k++)
+			list[i++] = block->index | JOURNAL_CLUSTER;
+	}
+	header->checksum = checksumBytes(txn, len);
+	
+	if(pwrite(vol->fd, txn, len, wal.loc + wal.head) != (ssize_t)len){
+		fprintf(stderr, "Whoops! Couldn't write to the journal!\n");
+		free(txn);
+		return false;
+	}
+	free(txn);
+	if(fdatasync(vol->fd) != 0)
+		fprintf(stderr, "Whoops! Couldn't sync %s!\n", vol->name);
+	
+	// committed; now the pages only have to get home eventually
+	for(int t = 0; t < 3; t++)
+		for(unsigned int p = 0; p < maps[t]->count; p++)
+			if(maps[t]->pages[p] & PAGE_DIRTY)
+				maps[t]->pages[p] = PAGE_LOGGED;
+	wal.head += len;
+	wal.sequence++;
+	wal.commits++;
+	wal.bytes += len;
+	return true;
+}
+
+/*
+* Writes every logged page back to its table and empties the journal.  The
+* tables have to be on disk before the MBR stops pointing at the old
+* transactions, and the MBR has to be on disk before new ones can reuse 
+* their space, hence the two syncs.
+*/
+void checkpointJournal(volume* vol, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table){
+	
+	if(wal.length == 0 || wal.head == 0)
+		return;
+	
+	updateFileTable(vol, MBR, file_table);
+	updateDirectoryTable(vol, MBR, dir_table);
+	updateChecksumTable(vol, MBR);
+	syncVolume(vol);
+	
+	MBR->journal_sequence = wal.sequence;
+	if(pwrite(vol->fd, MBR, sizeof(mbr), 0) != sizeof(mbr))
+		fprintf(stderr, "Whoops! Couldn't update the MBR!\n");
+	syncVolume(vol);
+	
+	wal.head = 0;
+	wal.checkpoints++;
+}
+
+/*
+* Empties the journal without touching the tables in memory, for when they
+* hold changes that aren't committed yet and so can't be written home: each
+* logged page image is copied from the journal to where it belongs instead.
+* Subdirectory clusters already went home right after they were logged.
+* Pages changed again since they were logged stay dirty.
+*/
+void drainJournal(volume* vol, mbr* MBR){
+	
+	// vars
+	unsigned int MAX_FILES = clusterCount(MBR), 
+		cluster_pages = (MBR->cluster_size + DIRTY_PAGE - 1) / DIRTY_PAGE;
+	size_t fat_len = sizeof(unsigned int) * MAX_FILES,
+		dir_len = sizeof(directory) * MAX_FILES, head = 0, len;
+	dirtymap* maps[] = {&fat_dirty, &dir_dirty, &sum_dirty};
+	off_t locs[] = {(off_t)MBR->FAT_index * MBR->cluster_size,
+		(off_t)MBR->dir_table_index * MBR->cluster_size,
+		(off_t)MBR->checksum_index * MBR->cluster_size};
+	size_t lengths[] = {fat_len, dir_len, 
+		sums.table != NULL ? fat_len : 0};
+	journal_header header;
+	
+	if(wal.length == 0 || wal.head == 0)
+		return;
+	
+	// every transaction up to the head was checked when it was written
+	while(head < wal.head){
+		if(pread(vol->fd, &header, sizeof(header), wal.loc + head) 
+				!= sizeof(header))
+			break;
+		len = (size_t)(header.pages + 1) * DIRTY_PAGE;
+		char* txn = (char*)malloc(len);
+		if(pread(vol->fd, txn, len, wal.loc + head) != (ssize_t)len){
+			fprintf(stderr, "Whoops! Couldn't read the journal!\n");
+			free(txn);
+			break;
+		}
+		unsigned int* list = (unsigned int*)(txn + sizeof(journal_header));
+		for(unsigned int i = 0; i < header.pages; i++){
+			unsigned int tag = list[i] & JOURNAL_TAGS;
+			if(tag == JOURNAL_CLUSTER){
+				i += cluster_pages - 1;
+				continue;
+			}
+			int t = tag == JOURNAL_DIR_PAGE ? 1 
+				: tag == JOURNAL_SUM_PAGE ? 2 : 0;
+			size_t start = (size_t)(list[i] & ~JOURNAL_TAGS) * DIRTY_PAGE,
+				count;
+			if(start >= lengths[t])
+				continue;
+			count = lengths[t] - start < DIRTY_PAGE ? lengths[t] - start 
+				: DIRTY_PAGE;
+			if(pwrite(vol->fd, txn + (size_t)(i + 1) * DIRTY_PAGE, count, 
+					locs[t] + start) != (ssize_t)count)
+				fprintf(stderr, "Whoops! Couldn't write a table page!\n");
+		}
+		free(txn);
+		head += len;
+	}
+	syncVolume(vol);
+	
+	MBR->journal_sequence = wal.sequence;
+	if(pwrite(vol->fd, MBR, sizeof(mbr), 0) != sizeof(mbr))
+		fprintf(stderr, "Whoops! Couldn't update the MBR!\n");
+	syncVolume(vol);
+	
+	for(int t = 0; t < 3; t++)
+		for(unsigned int p = 0; p < maps[t]->count; p++)
+			maps[t]->pages[p] &= ~PAGE_LOGGED;
+	wal.head = 0;
+	wal.checkpoints++;
+}
+
+/*
+* FNV-1a over a block of bytes; catches journal transactions that were only
+* partly written.
+*/
+unsigned int checksumBytes(const char* buf, size_t len){
+	unsigned int hash = 2166136261u;
+	for(size_t i = 0; i < len; i++){
+		hash ^= (unsigned char)buf[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+* Gets the cluster checksums ready: fills in the lookup tables for the 
+* software CRC32C and checks whether the CPU can do it for us.  The tables
+* are Castagnoli's (reflected) polynomial, extended for eight bytes at a 
+* time.
+*/
+void initChecksums(){
+	for(unsigned int i = 0; i < 256; i++){
+		unsigned int crc = i;
+		for(int bit = 0; bit < 8; bit++)
+			crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+		crc_tables[0][i] = crc;
+	}
+	for(unsigned int i = 0; i < 256; i++)
+		for(int t = 1; t < 8; t++)
+			crc_tables[t][i] = (crc_tables[t - 1][i] >> 8) 
+				^ crc_tables[0][crc_tables[t - 1][i] & 0xFF];
+	
+#if defined(__x86_64__)
+	sums.hardware = __builtin_cpu_supports("sse4.2");
+#else
+	sums.hardware = false;
+#endif
+}
+
+/*
+* CRC32C of a block of bytes, with the CPU's crc32 instruction if it has one.
+*/
+unsigned int crc32c(const char* buf, size_t len){
+#if defined(__x86_64__)
+	if(sums.hardware)
+		return ~crc32cHardware(0xFFFFFFFF, buf, len);
+#endif
+	return ~crc32cSoftware(0xFFFFFFFF, buf, len);
+}
+
+/*
+* Portable CRC32C; slicing-by-8, so eight table lookups per eight bytes
+* rather than one per byte.
+*/
+unsigned int crc32cSoftware(unsigned int crc, const char* buf, size_t len){
+	
+	// vars
+	const unsigned char* p = (const unsigned char*)buf;
+	unsigned int lo, hi;
+	
+	while(len >= 8){
+		lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24);
+		hi = p[4] | p[5] << 8 | p[6] << 16 | (unsigned int)p[7] << 24;
+		crc = crc_tables[7][lo & 0xFF] ^ crc_tables[6][(lo >> 8) & 0xFF] 
+			^ crc_tables[5][(lo >> 16) & 0xFF] ^ crc_tables[4][lo >> 24]
+			^ crc_tables[3][hi & 0xFF] ^ crc_tables[2][(hi >> 8) & 0xFF] 
+			^ crc_tables[1][(hi >> 16) & 0xFF] ^ crc_tables[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while(len-- != 0)
+		crc = crc_tables[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+/*
+* CRC32C with the SSE4.2 crc32 instruction, eight bytes at a time.  Only 
+* called once initChecksums() has seen the CPU supports it.
+*/
+__attribute__((target("sse4.2")))
+unsigned int crc32cHardware(unsigned int crc, const char* buf, size_t len){
+	
+	// vars
+	unsigned long long word, wide = crc;
+	
+	while(len >= 8){
+		memcpy(&word, buf, 8);
+		wide = _mm_crc32_u64(wide, word);
+		buf += 8;
+		len -= 8;
+	}
+	crc = wide;
+	while(len-- != 0)
+		crc = _mm_crc32_u8(crc, *buf++);
+	return crc;
+}
+#endif
+
+/*
+* Records the checksums of adjacent clusters that are being written from
+* a buffer.
+*/
+void recordChecksums(const char* buf, unsigned int index, unsigned int count,
+		unsigned int cluster_size){
+	if(sums.table == NULL || count == 0)
+		return;
+	for(unsigned int i = 0; i < count; i++)
+		sums.table[index + i] = crc32c(buf + (size_t)i * cluster_size, 
+			cluster_size);
+	markDirty(&sum_dirty, (size_t)index * sizeof(unsigned int), 
+		sizeof(unsigned int) * count);
+}
+
+/*
+* Checks adjacent clusters that were just read into a buffer against their
+* checksums, complaining about each one that doesn't match.  A read that 
+* turns up a bad cluster fails; there's no other copy to fall back on, so 
+* the data isn't handed on as if it were the file's.
+*
+* @returns				how many of the clusters didn't match
+*/
+unsigned int verifyClusters(const char* buf, unsigned int index, 
+		unsigned int count, unsigned int cluster_size){
+	
+	// vars
+	unsigned int bad = 0;
+	
+	if(sums.table == NULL)
+		return 0;
+	for(unsigned int i = 0; i < count; i++){
+		if(sums.table[index + i] == 0)
+			continue;
+		sums.verified++;
+		if(crc32c(buf + (size_t)i * cluster_size, cluster_size) 
+				!= sums.table[index + i]){
+			fprintf(stderr, "Woah! Cluster %u doesn't match its checksum!\n",
+				index + i);
+			sums.failed++;
+			bad++;
+		}
+	}
+	return bad;
+}
+
+/*
+* Prints all files currently in the root directory
+*/
+void printDirectoryTree(mbr* MBR, directory* dir_table, 
+		unsigned int* file_table, volume* vol){
+	
+	// vars 
+	unsigned int index = 0;
+	unsigned int MAX_FILES = clusterCount(MBR);
+	
+	// loop through all files
+	while(index < MAX_FILES){
+		if(dir_table[index].name[0] != 0x00 
+				&& (unsigned char)dir_table[index].name[0] != DELETED_FILE)
+			printDirectoryEntry(MBR, file_table, vol, &dir_table[index]);
+		index++;
+	}
+}
+
+/*
+* Prints one line of a directory listing.  A compressed file shows the size
+* it unpacks to, from its pack header, with what it takes up after it.
+*
+* Time formatting came from Source: 6
+*/
+void printDirectoryEntry(mbr* MBR, unsigned int* file_table, volume* vol, 
+		directory* entry){
+	
+	// vars
+	time_t raw = entry->timestamp;
+	struct tm * timeinfo = localtime(&raw);
+	char time[80];
+	chain_reader reader;
+	pack_header header;
+	
+	// format the time
+	strftime(time, 80, "%B %d, %Y %X", timeinfo);
+	
+	// print the file meta-data; flags don't change what kind of entry it is
+	cout << entry->name << " ";
+	if(entry->type & TYPE_COMPRESSED){
+		openChain(MBR, &reader, entry);
+		if(readChain(MBR, file_table, vol, &reader, &header, 
+				sizeof(pack_header)) && header.magic == PACK_MAGIC)
+			cout << header.size << "B (" << entry->size << "B packed)";
+		else
+			cout << entry->size << "B packed";
+		free(reader.buf);
+	}
+	else
+		cout << entry->size << "B";
+	if(entry->type & TYPE_INLINE)
+		cout << " Inline";
+	else
+		cout << " Cluster #: " << entry->index;
+	cout << " Type: " 
+		<< ((entry->type & TYPE_MASK) == TYPE_FILE ? "File" : "Directory")
+		<< (entry->type & TYPE_COMPRESSED ? " (compressed)" : "")
+		<< " @ " << time << endl;
+}
+
+/*
+* Lists a subdirectory, which is already in name order.
+*
+* @param	dir				the subdirectory's first cluster
+*/
+void listDirectory(mbr* MBR, unsigned int* file_table, volume* vol, 
+		unsigned int dir){
+	
+	// vars
+	dir_reader reader;
+	directory* entry;
+	
+	openDirectory(MBR, vol, &reader, dir);
+	while((entry = nextDirectoryEntry(MBR, file_table, vol, &reader)) 
+			!= NULL)
+		printDirectoryEntry(MBR, file_table, vol, entry);
+	free(reader.buf);
+}
+
+/*
+* Reads a subdirectory cluster, preferring a copy changed since the last 
+* commit.
+*/
+void readDirectoryBlock(mbr* MBR, unsigned int index, char* buf, 
+		volume* vol){
+	for(pending_block* block = pending_blocks; block; block = block->next){
+		if(block->index == index){
+			memcpy(buf, block->data, MBR->cluster_size);
+			return;
+		}
+	}
+	readCluster(MBR, buf, index, MBR->cluster_size, vol);
+}
+
+/*
+* Records a changed subdirectory cluster.  Nothing goes to the disk until
+* the commit, which logs the cluster before writing it home, so directories
+* change atomically with the tables.
+*/
+void writeDirectoryBlock(mbr* MBR, unsigned int index, char* buf){
+	
+	// vars
+	pending_block* block = pending_blocks;
+	
+	while(block != NULL && block->index != index)
+		block = block->next;
+	if(block == NULL){
+		block = (pending_block*)malloc(sizeof(pending_block));
+		block->index = index;
+		block->data = (char*)malloc(MBR->cluster_size);
+		block->next = pending_blocks;
+		pending_blocks = block;
+	}
+	memcpy(block->data, buf, MBR->cluster_size);
+}
+
+/*
+* Drops any uncommitted copy of a cluster that is being freed, so it can't
+* be written over whatever gets the cluster next.
+*/
+void forgetDirectoryBlock(unsigned int index){
+	for(pending_block** link = &pending_blocks; *link; 
+			link = &(*link)->next){
+		if((*link)->index == index){
+			pending_block* block = *link;
+			*link = block->next;
+			free(block->data);
+			free(block);
+			return;
+		}
+	}
+}
+
+/*
+* Hands every changed subdirectory cluster to the cluster cache once it is 
+* safe for it to reach its home location.
+*/
+void flushDirectoryBlocks(mbr* MBR, volume* vol){
+	while(pending_blocks != NULL){
+		pending_block* block = pending_blocks;
+		pending_blocks = block->next;
+		writeCluster(MBR, block->index, block->data, vol);
+		free(block->data);
+		free(block);
+	}
+}
+
+/*
+* Returns the cluster holding a given block of a subdirectory.
+*/
+unsigned int directoryBlock(unsigned int* file_table, unsigned int dir, 
+		unsigned int block){
+	while(block-- != 0)
+		dir = file_table[dir];
+	return dir;
+}
+
+/*
+* Sets up an empty subdirectory in a fresh cluster.
+*
+* @returns				the cluster, or MAX_FILES if the disk is full
+*/
+unsigned int newDirectoryBlocks(mbr* MBR, unsigned int* file_table){
+	
+	// vars
+	unsigned int MAX_FILES = clusterCount(MBR), 
+		index = findFreeCluster(MBR, file_table);
+	char buf[MBR->cluster_size];
+	dir_header* header = (dir_header*)buf;
+	
+	if(index == MAX_FILES)
+		return MAX_FILES;
+	setFileTableEntry(file_table, index, LAST_CLUSTER);
+	
+	memset(buf, 0, MBR->cluster_size);
+	header->magic = DIR_SLACK_MAGIC;
+	header->blocks = 1;
+	writeDirectoryBlock(MBR, index, buf);
+	return index;
+}
+
+/*
+* Returns how many clusters a subdirectory says it has, given its first one.
+*/
+unsigned int directoryBlocks(mbr* MBR, char* buf){
+	
+	// vars
+	dir_header* header = (dir_header*)buf;
+	
+	if(header->magic == DIR_SLACK_MAGIC)
+		return header->blocks;
+	return header->count / (MBR->cluster_size / sizeof(directory)) + 1;
+}
+
+/*
+* Returns the slot just past the last entry in a subdirectory cluster.
+*
+* @param	first			the cluster's first entry slot (1 in the first 
+*							cluster, after the header)
+*/
+unsigned int blockEnd(directory* slots, unsigned int first, 
+		unsigned int per_block){
+	while(first < per_block && slots[first].name[0] != '\0')
+		first++;
+	return first;
+}
+
+/*
+* Gets ready to read a subdirectory's entries from the start.  The caller 
+* frees the reader's buffer when it's done.
+*/
+void openDirectory(mbr* MBR, volume* vol, dir_reader* reader, 
+		unsigned int dir){
+	reader->buf = (char*)malloc(MBR->cluster_size);
+	readDirectoryBlock(MBR, dir, reader->buf, vol);
+	reader->cluster = dir;
+	reader->slot = 0;
+	reader->blocks = directoryBlocks(MBR, reader->buf);
+}
+
+/*
+* Returns the next entry of a subdirectory, skipping the room left at the 
+* end of each cluster.
+*
+* @returns				the entry, in the reader's buffer, or NULL once 
+*						they've all been read (or the chain ends early)
+*/
+directory* nextDirectoryEntry(mbr* MBR, unsigned int* file_table, 
+		volume* vol, dir_reader* reader){
+	
+	// vars
+	unsigned int per_block = MBR->cluster_size / sizeof(directory);
+	directory* entry;
+	
+	while(true){
+		reader->slot++;
+		if(reader->slot % per_block == 0){
+			if(--reader->blocks == 0)
+				return NULL;
+			reader->cluster = file_table[reader->cluster];
+			if(!isClusterLink(reader->cluster))
+				return NULL;
+			readDirectoryBlock(MBR, reader->cluster, reader->buf, vol);
+		}
+		entry = (directory*)reader->buf + reader->slot % per_block;
+		if(entry->name[0] != '\0')
+			return entry;
+		
+		// nothing else in this cluster
+		reader->slot = (reader->slot / per_block + 1) * per_block - 1;
+	}
+}
+
+/*
+* Binary searches a subdirectory for a name: first for the cluster it would
+* be in, by each cluster's first name, then within that cluster.  The 
+* directory's chain is walked once up front, so each probe goes straight 
+* to its cluster instead of following the FAT from the start again.
+*
+* @param	dir				the subdirectory's first cluster
+* @param	slot			receives the slot of the entry, or the slot it 
+*							would be inserted at
+* @param	entry			receives a copy of the entry (may be NULL)
+*
+* @returns				true if the name is there
+*/
+bool searchDirectory(mbr* MBR, unsigned int* file_table, volume* vol, 
+		unsigned int dir, char* name, unsigned int* slot, directory* entry){
+	
+	// vars
+	unsigned int per_block = MBR->cluster_size / sizeof(directory), lo = 0, 
+		hi, mid, loaded = 0, *chain;
+	char buf[MBR->cluster_size];
+	directory* slots = (directory*)buf;
+	int cmp;
+	
+	readDirectoryBlock(MBR, dir, buf, vol);
+	hi = directoryBlocks(MBR, buf);
+	if(hi == 0)
+		hi = 1;
+	chain = (unsigned int*)malloc(sizeof(unsigned int) * hi);
+	chain[0] = dir;
+	for(unsigned int b = 1; b < hi; b++){
+		chain[b] = file_table[chain[b - 1]];
+		if(!isClusterLink(chain[b]))
+			hi = b;
+	}
+	
+	// the last cluster whose first name doesn't sort after this one; only
+	// the first cluster may be empty, and it always qualifies
+	while(hi - lo > 1){
+		mid = lo + (hi - lo) / 2;
+		readDirectoryBlock(MBR, chain[mid], buf, vol);
+		loaded = mid;
+		if(strncmp(slots[0].name, name, sizeof(slots[0].name)) <= 0)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	if(loaded != lo)
+		readDirectoryBlock(MBR, chain[lo], buf, vol);
+	free(chain);
+	
+	mid = lo;
+	lo = mid == 0 ? 1 : 0;
+	hi = blockEnd(slots, lo, per_block);
+	while(lo < hi){
+		unsigned int probe = lo + (hi - lo) / 2;
+		cmp = strncmp(slots[probe].name, name, sizeof(slots[probe].name));
+		if(cmp == 0){
+			*slot = mid * per_block + probe;
+			if(entry != NULL)
+				*entry = slots[probe];
+			return true;
+		}
+		if(cmp < 0)
+			lo = probe + 1;
+		else
+			hi = probe;
+	}
+	*slot = mid * per_block + lo;
+	return false;
+}
+
+/*
+* Resolves a path inside the volume, one component at a time: the first 
+* goes through the root's hash index, the rest through binary searches of
+* each subdirectory.  An empty path is the root itself, which comes back as
+* a directory starting at cluster MAX_FILES.
+*
+* @param	path			the path, without the filesystem name
+* @param	ref				receives where the entry lives
+* @param	entry			receives a copy of the entry
+*
+* @returns				true if the path exists
+*/
+bool findEntry(mbr* MBR, directory* dir_table, unsigned int* file_table, 
+		volume* vol, char* path, entry_ref* ref, directory* entry){
+	
+	// vars
+	unsigned int slot;
+	char name[sizeof(entry->name)];
+	size_t len;
+	
+	memset(entry, 0, sizeof(directory));
+	entry->index = MAX_FILES;
+	entry->type = TYPE_DIRECTORY;
+	ref->dir = ref->slot = MAX_FILES;
+	
+	while(true){
+		
+		// pull out the next component
+		while(*path == '/')
+			path++;
+		if(*path == '\0')
+			return true;
+		len = strcspn(path, "/");
+		if(len >= sizeof(name))
+			return false;
+		memcpy(name, path, len);
+		name[len] = '\0';
+		path += len;
+		
+		// only directories have anything below them
+		if((entry->type & TYPE_MASK) != TYPE_DIRECTORY)
+			return false;
+		ref->dir = entry->index;
+		if(ref->dir == MAX_FILES){
+			slot = findDirectoryIndexOfFile(dir_table, name);
+			if(slot == MAX_FILES)
+				return false;
+			*entry = dir_table[slot];
+		}
+		else if(!searchDirectory(MBR, file_table, vol, ref->dir, name, &slot,
+				entry))
+			return false;
+		ref->slot = slot;
+	}
+}
+
+/*
+* Resolves everything but the last component of a path, which has to be a
+* directory.
+*
+* @param	dir				receives the directory's first cluster (MAX_FILES
+*							for the root)
+* @param	leaf			receives the last component
+*
+* @returns				false if the directory doesn't exist
+*/
+bool findParent(mbr* MBR, directory* dir_table, unsigned int* file_table, 
+		volume* vol, char* path, unsigned int* dir, char** leaf){
+	
+	// vars
+	char* slash = strrchr(path, '/');
+	entry_ref ref;
+	directory entry;
+	
+	*leaf = slash == NULL ? path : slash + 1;
+	*dir = MAX_FILES;
+	if(slash == NULL)
+		return true;
+	
+	char parent[slash - path + 1];
+	memcpy(parent, path, slash - path);
+	parent[slash - path] = '\0';
+	if(!findEntry(MBR, dir_table, file_table, vol, parent, &ref, &entry)
+			|| (entry.type & TYPE_MASK) != TYPE_DIRECTORY)
+		return false;
+	*dir = entry.index;
+	return true;
+}
+
+/*
+* Adds an entry to a directory under a new name.  Root entries get a free 
+* slot and go in the hash index; subdirectory entries are inserted in name 
+* order into the cluster they belong in, which is split in two first if it's
+* full.
+*
+* @param	dir				the directory's first cluster (MAX_FILES for the
+*							root)
+* @param	name			the new entry's name
+* @param	entry			everything else about the entry; its name gets
+*							filled in
+*
+* @returns				false (after saying why) if it couldn't be added
+*/
+bool addEntry(mbr* MBR, directory* dir_table, unsigned int* file_table, 
+		volume* vol, unsigned int dir, char* name, directory* entry){
+	
+	// vars
+	unsigned int MAX_FILES = clusterCount(MBR), 
+		per_block = MBR->cluster_size / sizeof(directory), slot, blocks, 
+		cluster, split = MAX_FILES, pos, end, half;
+	char buf[MBR->cluster_size], split_buf[MBR->cluster_size], 
+		data[sizeof(entry->name)];
+	directory* target = (directory*)buf;
+	
+	if(name[0] == '\0'){
+		fprintf(stderr, "What!? No filename?!\n");
+		return false;
+	}
+	
+	// an inline file's data has to move along behind its new name
+	if(entry->type & TYPE_INLINE){
+		if(strlen(name) < sizeof(entry->name) 
+				&& !fitsInline(name, entry->size)){
+			fprintf(stderr, "Sorry, %s leaves no room for its data!\n", name);
+			return false;
+		}
+		memcpy(data, inlineData(entry), entry->size);
+	}
+	
+	if(dir == MAX_FILES){
+		slot = newDirectoryEntry(MBR, dir_table, name, entry->size);
+		if(slot == MAX_FILES)
+			return false;
+		dir_table[slot].index = entry->index;
+		dir_table[slot].type = entry->type;
+		if(entry->type & TYPE_INLINE)
+			memcpy(inlineData(&dir_table[slot]), data, entry->size);
+		*entry = dir_table[slot];
+		indexDirectoryEntry(dir_table, slot);
+		return true;
+	}
+	
+	// makes sure the file name isn't too long, or already taken
+	if(strlen(name) >= sizeof(entry->name)){
+		fprintf(stderr, "Sorry, %s is too long for a file name!\n", name);
+		return false;
+	}
+	if(searchDirectory(MBR, file_table, vol, dir, name, &slot, NULL)){
+		fprintf(stderr, "Sorry, %s already exists!\n", name);
+		return false;
+	}
+	memset(entry->name, 0, sizeof(entry->name));
+	strcpy(entry->name, name);
+	if(entry->type & TYPE_INLINE)
+		memcpy(inlineData(entry), data, entry->size);
+	
+	// a DIR1 directory only needs its header brought up to date
+	readDirectoryBlock(MBR, dir, buf, vol);
+	blocks = directoryBlocks(MBR, buf);
+	if(((dir_header*)buf)->magic != DIR_SLACK_MAGIC)
+		setDirectoryBlocks(MBR, vol, dir, blocks);
+	
+	cluster = directoryBlock(file_table, dir, slot / per_block);
+	pos = slot % per_block;
+	readDirectoryBlock(MBR, cluster, buf, vol);
+	end = blockEnd(target, slot < per_block ? 1 : 0, per_block);
+	
+	// a full cluster gives its top half to a new one linked in after it
+	if(end == per_block){
+		split = findFreeCluster(MBR, file_table);
+		if(split == MAX_FILES){
+			fprintf(stderr, "Woah! No more room for file entries!\n");
+			return false;
+		}
+		half = ((slot < per_block ? 1 : 0) + per_block) / 2;
+		memset(split_buf, 0, MBR->cluster_size);
+		memcpy(split_buf, &target[half], (per_block - half) 
+			* sizeof(directory));
+		memset(&target[half], 0, (per_block - half) * sizeof(directory));
+		setFileTableEntry(file_table, split, file_table[cluster]);
+		setFileTableEntry(file_table, cluster, split);
+		end = half;
+		if(pos > half){
+			target = (directory*)split_buf;
+			pos -= half;
+			end = per_block - half;
+		}
+	}
+	
+	memmove(&target[pos + 1], &target[pos], (end - pos) * sizeof(directory));
+	target[pos] = *entry;
+	writeDirectoryBlock(MBR, cluster, buf);
+	if(split != MAX_FILES){
+		writeDirectoryBlock(MBR, split, split_buf);
+		setDirectoryBlocks(MBR, vol, dir, blocks + 1);
+	}
+	
+	return true;
+}
+
+/*
+* Writes a changed copy of an entry back where it lives.  Names must not 
+* change this way; that would break the order of a subdirectory.
+*/
+void storeEntry(mbr* MBR, directory* dir_table, unsigned int* file_table, 
+		volume* vol, entry_ref ref, directory* entry){
+	
+	// vars
+	unsigned int per_block = MBR->cluster_size / sizeof(directory), cluster;
+	char buf[MBR->cluster_size];
+	
+	if(ref.dir == MAX_FILES){
+		dir_table[ref.slot] = *entry;
+		markDirectoryEntryDirty(ref.slot);
+		return;
+	}
+	
+	cluster = directoryBlock(file_table, ref.dir, ref.slot / per_block);
+	readDirectoryBlock(MBR, cluster, buf, vol);
+	((directory*)buf)[ref.slot % per_block] = *entry;
+	writeDirectoryBlock(MBR, cluster, buf);
+}
+
+/*
+* How many bytes of data an entry can hold inline alongside a given name: 
+* whatever is left of the name field past its terminator.
+*/
+size_t inlineRoom(const char* name){
+	
+	// vars
+	size_t len = strnlen(name, sizeof(((directory*)NULL)->name));
+	
+	return len < sizeof(((directory*)NULL)->name) 
+		? sizeof(((directory*)NULL)->name) - len - 1 : 0;
+}
+
+bool fitsInline(const char* name, size_t size){
+	return strnlen(name, sizeof(((directory*)NULL)->name)) 
+		< sizeof(((directory*)NULL)->name) && size <= inlineRoom(name);
+}
+
+/*
+* Where an inline file's data starts: straight after its name.
+*/
+char* inlineData(directory* entry){
+	return entry->name + strlen(entry->name) + 1;
+}
+
+/*
+* Puts a file's data into its entry, behind the name already there.  Any
+* chain the file had must have been let go of first.
+*/
+void setInline(directory* entry, const char* data, size_t size){
+	
+	// vars
+	char* start = inlineData(entry);
+	
+	memset(start, 0, inlineRoom(entry->name));
+	memcpy(start, data, size);
+	entry->index = LAST_CLUSTER;
+	entry->size = size;
+	entry->type = (entry->type & ~TYPE_SHARED) | TYPE_INLINE;
+	entry->timestamp = time(NULL);
+}
+
+/*
+* Moves an inline file's data out into a cluster of its own, for when it no
+* longer fits in the entry.
+*
+* @returns				false (after saying why) if there's no cluster free
+*/
+bool spillInline(mbr* MBR, unsigned int* file_table, volume* vol, 
+		directory* entry){
+	
+	// vars
+	unsigned int MAX_FILES = clusterCount(MBR), cluster;
+	char buf[MBR->cluster_size];
+	
+	cluster = findFreeCluster(MBR, file_table);
+	if(cluster == MAX_FILES){
+		fprintf(stderr, "Sorry, there isn't enough room for %s!\n", 
+			entry->name);
+		return false;
+	}
+	setFileTableEntry(file_table, cluster, LAST_CLUSTER);
+	
+	memset(buf, 0, MBR->cluster_size);
+	memcpy(buf, inlineData(entry), entry->size);
+	writeCluster(MBR, cluster, buf, vol);
+	
+	memset(inlineData(entry), 0, inlineRoom(entry->name));
+	entry->index = cluster;
+	entry->type &= ~TYPE_INLINE;
+	return true;
+}
+
+/*
+* Takes an entry out of its directory and frees whatever clusters only it
+* was using.  In a subdirectory the entries after it in its cluster shift 
+* back a slot, and a cluster left empty is taken out of the chain (unless 
+* it's the first, which holds the header).
+*/
+void removeEntry(mbr* MBR, directory* dir_table, unsigned int* file_table, 
+		volume* vol, entry_ref ref){
+	
+	// vars
+	unsigned int per_block = MBR->cluster_size / sizeof(directory), blocks,
+		block = ref.slot / per_block, cluster, pos = ref.slot % per_block, 
+		start = block == 0 ? 1 : 0, end, first;
+	char buf[MBR->cluster_size];
+	directory* slots = (directory*)buf;
+	
+	if(ref.dir == MAX_FILES){
+		first = dir_table[ref.slot].index;
+		deleteFile(dir_table, file_table, ref.slot);
+		if(isClusterLink(first)){
+			ref_counts[first]--;
+			releaseChain(file_table, first);
+		}
+		return;
+	}
+	
+	// a DIR1 directory only needs its header brought up to date
+	readDirectoryBlock(MBR, ref.dir, buf, vol);
+	blocks = directoryBlocks(MBR, buf);
+	if(((dir_header*)buf)->magic != DIR_SLACK_MAGIC)
+		setDirectoryBlocks(MBR, vol, ref.dir, blocks);
+	
+	// pull the rest of the cluster back a slot
+	cluster = directoryBlock(file_table, ref.dir, block);
+	readDirectoryBlock(MBR, cluster, buf, vol);
+	first = slots[pos].index;
+	end = blockEnd(slots, start, per_block);
+	memmove(&slots[pos], &slots[pos + 1], (end - pos - 1) 
+		* sizeof(directory));
+	memset(&slots[end - 1], 0, sizeof(directory));
+	
+	if(end - 1 == start && block != 0){
+		setFileTableEntry(file_table, 
+			directoryBlock(file_table, ref.dir, block - 1), 
+			file_table[cluster]);
+		releaseChain(file_table, cluster);
+		setDirectoryBlocks(MBR, vol, ref.dir, blocks - 1);
+	}
+	else
+		writeDirectoryBlock(MBR, cluster, buf);
+	
+	// last of all the entry's own chain, now that nothing points at it
+	if(isClusterLink(first)){
+		ref_counts[first]--;
+		releaseChain(file_table, first);
+	}
+}
+
+/*
+* Returns how many entries a subdirectory holds.
+*/
+unsigned int directoryCount(mbr* MBR, unsigned int* file_table, volume* vol,
+		unsigned int dir){
+	
+	// vars
+	dir_reader reader;
+	unsigned int count = 0;
+	
+	openDirectory(MBR, vol, &reader, dir);
+	while(nextDirectoryEntry(MBR, file_table, vol, &reader) != NULL)
+		count++;
+	free(reader.buf);
+	return count;
+}
+
+/*
+* Updates the cluster count in a subdirectory's header, which makes it a
+* DIR2 directory if it wasn't already.
+*/
+void setDirectoryBlocks(mbr* MBR, volume* vol, unsigned int dir, 
+		unsigned int blocks){
+	
+	// vars
+	char buf[MBR->cluster_size];
+	dir_header* header = (dir_header*)buf;
+	
+	readDirectoryBlock(MBR, dir, buf, vol);
+	header->magic = DIR_SLACK_MAGIC;
+	header->count = 0;
+	header->blocks = blocks;
+	writeDirectoryBlock(MBR, dir, buf);
+}
+
+/*
+* Creates an empty subdirectory.
+*
+* @param	path			the new directory's path, without the filesystem
+*							name
+*/
+void makeDirectory(char* path, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table, volume* vol){
+	
+	if(addDirectory(path, MBR, dir_table, file_table, vol) == MAX_FILES)
+		return;
+	
+	// lastly, write the tables to disk!
+	commitCommand(vol, MBR, dir_table, file_table);
+}
+
+/*
+* Creates an empty subdirectory, leaving the commit to the caller.
+*
+* @returns				the new directory's first cluster, or MAX_FILES 
+*						(after saying why) if it couldn't be made
+*/
+unsigned int addDirectory(char* path, mbr* MBR, directory* dir_table, 
+		unsigned int* file_table, volume* vol){
+	
+	// vars
+	unsigned int dir;
+	char* leaf;
+	directory entry;
+	
+	if(!findParent(MBR, dir_table, file_table, vol, path, &dir, &leaf)){
+		fprintf(stderr, "Sorry, there's no directory to put %s in!\n", path);
+		return MAX_FILES;
+	}
+	
+	memset(&entry, 0, sizeof(directory));
+	entry.index = newDirectoryBlocks(MBR, file_table);
+	if(entry.index == MAX_FILES){
+		fprintf(stderr, "Woah! No more room for file entries!\n");
+		return MAX_FILES;
+	}
+	entry.size = 0;
+	entry.type = TYPE_DIRECTORY;
+	entry.timestamp = time(NULL);
+	
+	if(!addEntry(MBR, dir_table, file_table, vol, dir, leaf, &entry)){
+		forgetDirectoryBlock(entry.index);
+		setFileTableEntry(file_table, entry.index, FREE_CLUSTER);
+		return MAX_FILES;
+	}
+	ref_counts[entry.index]++;
+	return entry.index;
+}
+
+/*
+* Forgets every changed subdirectory cluster that isn't part of a directory
+* reachable from the root.
+*/
+void dropStaleDirectoryBlocks(mbr* MBR, directory* dir_table, 
+		unsigned int* file_table, volume* vol){
+	
+	// vars
+	unsigned int MAX_FILES = clusterCount(MBR);
+	pending_block** link = &pending_blocks;
+	bool* live;
+	
+	if(pending_blocks == NULL)
+		return;
+	live = (bool*)calloc(MAX_FILES, sizeof(bool));
+	for(unsigned int i = 0; i < MAX_FILES; i++){
+		if(dir_table[i].name[0] != 0x00 
+				&& (unsigned char)dir_table[i].name[0] != DELETED_FILE
+				&& (dir_table[i].type & TYPE_MASK) == TYPE_DIRECTORY
+				&& isClusterLink(dir_table[i].index))
+			markDirectoryChain(MBR, file_table, vol, dir_table[i].index, live);
+	}
+	
+	while(*link != NULL){
+		pending_block* block = *link;
+		if(live[block->index])
+			link = &block->next;
+		else{
+			*link = block->next;
+			free(block->data);
+			free(block);
+		}
+	}
+	free(live);
+}
+
+/*
+* Marks the clusters of a subdirectory, and of every directory below it.
+*/
+void markDirectoryChain(mbr* MBR, unsigned int* file_table, volume* vol, 
+		unsigned int dir, bool* live){
+	
+	// vars
+	dir_reader reader;
+	directory* entry;
+	
+	if(live[dir])
+		return;
+	for(unsigned int c = dir; isClusterLink(c) && !live[c]; c = file_table[c])
+		live[c] = true;
+	
+	openDirectory(MBR, vol, &reader, dir);
+	while((entry = nextDirectoryEntry(MBR, file_table, vol, &reader)) 
+			!= NULL){
+		if((entry->type & TYPE_MASK) == TYPE_DIRECTORY 
+				&& isClusterLink(entry->index))
+			markDirectoryChain(MBR, file_table, vol, entry->index, live);
+	}
+	free(reader.buf);
+}
+
+/*
+* Adds the references made from inside a subdirectory (and everything below
+* it) to the reference counts.
+*/
+void countDirectoryRefs(mbr* MBR, unsigned int* file_table, volume* vol, 
+		unsigned int dir){
+	
+	// vars
+	dir_reader reader;
+	directory* entry;
+	
+	openDirectory(MBR, vol, &reader, dir);
+	while((entry = nextDirectoryEntry(MBR, file_table, vol, &reader)) 
+			!= NULL){
+		if(isClusterLink(entry->index))
+			ref_counts[entry->index]++;
+		if((entry->type & TYPE_MASK) == TYPE_DIRECTORY 
+				&& isClusterLink(entry->index))
+			countDirectoryRefs(MBR, file_table, vol, entry->index);
+	}
+	free(reader.buf);
+}
+
+/*
+* Summarizes how the volume's space is used in one pass over the FAT: used,
+* free and reserved clusters, the free extents, and how fragmented the files
+* are (one walk of each chain, so linear in the size of the volume too).
+*
+* @param	show_map		also print the volume as runs of used, free and
+*							reserved clusters
+*/
+void showFileSystemStructure(mbr* MBR, directory* dir_table, 
+		unsigned int* file_table, volume* vol, bool show_map){
+	
+	// vars
+	unsigned int MAX_FILES = clusterCount(MBR), kb = MBR->cluster_size 
+		/ KILOBYTE, counts[3] = {0, 0, 0}, free_extents = 0, largest = 0, 
+		largest_at = 0, run = 0, run_start = 0, kind, prev_kind = 0, 
+		count = 0, cap = 0, shared = 0, shown = 0;
+	const char* kinds[] = {"free", "reserved", "used"};
+	frag_file* list = NULL;
+	
+	for(unsigned int c = 0; c <= MAX_FILES; c++){
+		
+		// one past the end closes off the last run
+		if(c == MAX_FILES)
+			kind = 3;
+		else if(file_table[c] == FREE_CLUSTER)
+			kind = 0;
+		else if(file_table[c] == RESERVE_CLUSTER)
+			kind = 1;
+		else
+			kind = 2;
+		
+		if(c != 0 && kind != prev_kind){
+			if(show_map)
+				cout << "Clusters " << run_start << "-" << c - 1 << ": " 
+					<< kinds[prev_kind] << endl;
+			if(prev_kind == 0){
+				free_extents++;
+				if(run > largest){
+					largest = run;
+					largest_at = run_start;
+				}
+			}
+			run = 0;
+			run_start = c;
+		}
+		if(kind != 3)
+			counts[kind]++;
+		run++;
+		prev_kind = kind;
+	}
+	
+	cout << "Clusters: " << MAX_FILES << " of " << kb << "KB, " << counts[2] 
+		<< " used, " << counts[0] << " free, " << counts[1] << " reserved" 
+		<< endl;
+	cout << "Free: " << counts[0] * kb << "KB in " << free_extents 
+		<< " extent(s)";
+	if(largest != 0)
+		cout << ", largest " << largest * kb << "KB at cluster " 
+			<< largest_at;
+	cout << endl;
+	
+	// then the files, most fragmented first
+	collectFiles(MBR, dir_table, file_table, vol, MAX_FILES, &list, &count,
+		&cap);
+	for(unsigned int i = 0; i < count; i++)
+		shared += list[i].extents == 0;
+	printFragmentation("Files", list, count, shared);
+	qsort(list, count, sizeof(frag_file), compareFragments);
+	for(unsigned int i = 0; i < count && list[i].extents > 1; i++){
+		if(shown++ < 10)
+			cout << "  " << list[i].entry.name << ": " << list[i].extents 
+				<< " extents over " << list[i].clusters << " clusters" 
+				<< endl;
+	}
+	if(shown > 10)
+		cout << "  ... and " << shown - 10 << " more" << endl;
+	free(list);
+}
+
+/*
+* Rewrites fragmented files into contiguous runs, most fragmented first.  
+* Each file is copied to a free run big enough to hold it, then its entry is
+* pointed at the copy and the old chain freed, all in one commit; so the
+* volume is consistent after every file, ^C stops it between files, and 
+* running it again carries on where it left off.  Files sharing clusters 
+* with copies are left alone, as are files no free run is big enough for 
+* and files that couldn't be copied.
+* Like sync, every commit also commits whatever a script had pending.
+*/
+void defragVolume(mbr* MBR, directory* dir_table, unsigned int* file_table,
+		volume* vol){
+	
+	// vars
+	unsigned int count = 0, cap = 0, moved = 0, moved_clusters = 0, 
+		skipped = 0, failed = 0, shared = 0, start, index, run, next, done, 
+		got;
+	bool ok;
+	frag_file* list = NULL;
+	struct sigaction stop, old;
+	
+	// the free runs the moves are planned around include clusters that are
+	// committed free but still being punched
+	collectHoles(true);
+	
+	collectFiles(MBR, dir_table, file_table, vol, MAX_FILES, &list, &count,
+		&cap);
+	for(unsigned int i = 0; i < count; i++)
+		shared += list[i].extents == 0;
+	printFragmentation("Before", list, count, shared);
+	qsort(list, count, sizeof(frag_file), compareFragments);
+	
+	// ^C finishes the current file and stops
+	stop.sa_handler = stopDefrag;
+	stop.sa_flags = 0;
+	sigemptyset(&stop.sa_mask);
+	defrag_stop = 0;
+	sigaction(SIGINT, &stop, &old);
+	
+	// the copies work on the image directly
+	flushClusterCache(vol);
+	for(unsigned int i = 0; i < count && list[i].extents > 1 && !defrag_stop;
+			i++){
+		got = allocateRun(MBR, file_table, list[i].clusters, &start);
+		ok = got == list[i].clusters;
+		
+		// copy the file a run at a time
+		index = list[i].entry.index;
+		for(done = 0; ok && done < list[i].clusters; done += run){
+			run = chainRunLength(MBR, file_table, index, 
+				list[i].clusters - done, &next);
+			ok = copyClusters(MBR, vol, index, start + done, run);
+			index = next;
+		}
+		
+		// a run that's too short, or a copy that didn't get done, is given
+		// back and the file stays where it was
+		if(!ok){
+			for(index = start; got != 0 && isClusterLink(index); 
+					index = next){
+				next = file_table[index];
+				setFileTableEntry(file_table, index, FREE_CLUSTER);
+			}
+			if(got != list[i].clusters)
+				skipped++;
+			else
+				failed++;
+			continue;
+		}
+		
+		// then swap the copy in for the original
+		index = list[i].entry.index;
+		list[i].entry.index = start;
+		ref_counts[start]++;
+		storeEntry(MBR, dir_table, file_table, vol, list[i].ref, 
+			&list[i].entry);
+		ref_counts[index]--;
+		releaseChain(file_table, index);
+		commitTables(vol, MBR, dir_table, file_table);
+		
+		moved++;
+		moved_clusters += list[i].clusters;
+	}
+	sigaction(SIGINT, &old, NULL);
+	
+	cout << "Moved " << moved << " file(s), " << moved_clusters 
+		<< " clusters";
+	if(skipped != 0)
+		cout << "; " << skipped << " didn't fit in any free run";
+	if(failed != 0)
+		cout << "; " << failed << " couldn't be copied";
+	cout << endl;
+	if(defrag_stop)
+		cout << "Stopped early; run defrag again to carry on" << endl;
+	
+	count = 0;
+	collectFiles(MBR, dir_table, file_table, vol, MAX_FILES, &list, &count,
+		&cap);
+	printFragmentation("After", list, count, shared);
+	free(list);
+}
+
+/*
+* Adds every file in a directory, and in the directories below it, to the
+* defragmenter's list.
+*
+* @param	dir				the directory's first cluster (MAX_FILES for the
+*							root)
+*/
+void collectFiles(mbr* MBR, directory* dir_table, unsigned int* file_table, 
+		volume* vol, unsigned int dir, frag_file** list, unsigned int* count,
+		unsigned int* cap){
+	
+	// vars
+	dir_reader reader;
+	directory* next;
+	frag_file file;
+	
+	file.ref.dir = dir;
+	if(dir != MAX_FILES)
+		openDirectory(MBR, vol, &reader, dir);
+	
+	for(unsigned int slot = 0; ; slot++){
+		if(dir == MAX_FILES){
+			if(slot == MAX_FILES)
+				break;
+			file.entry = dir_table[slot];
+			if(file.entry.name[0] == 0x00 
+					|| (unsigned char)file.entry.name[0] == DELETED_FILE)
+				continue;
+			file.ref.slot = slot;
+		}
+		else{
+			next = nextDirectoryEntry(MBR, file_table, vol, &reader);
+			if(next == NULL)
+				break;
+			file.entry = *next;
+			file.ref.slot = reader.slot;
+		}
+		
+		if((file.entry.type & TYPE_MASK) == TYPE_DIRECTORY){
+			if(isClusterLink(file.entry.index))
+				collectFiles(MBR, dir_table, file_table, vol, 
+					file.entry.index, list, count, cap);
+			continue;
+		}
+		
+		// inline files have nothing to lay out, and shared files are listed 
+		// with no extents, so they're never moved
+		if(file.entry.type & TYPE_INLINE)
+			continue;
+		if(!measureChain(file_table, file.entry.index, &file.clusters, 
+				&file.extents))
+			file.extents = 0;
+		if(*count == *cap){
+			*cap = *cap == 0 ? 64 : *cap * 2;
+			*list = (frag_file*)realloc(*list, sizeof(frag_file) * *cap);
+		}
+		(*list)[(*count)++] = file;
+	}
+	if(dir != MAX_FILES)
+		free(reader.buf);
+}
+
+/*
+* Walks a chain, counting its clusters and the contiguous runs (extents) 
+* they form.
+*
+* @returns				false if any of the clusters is shared, or the 
+*						chain loops
+*/
+bool measureChain(unsigned int* file_table, unsigned int index, 
+		unsigned int* clusters, unsigned int* extents){
+	
+	*clusters = 0;
+	*extents = 0;
+	for(unsigned int prev = MAX_FILES; isClusterLink(index); 
+			index = file_table[index]){
+		if(ref_counts[index] > 1 || *clusters == MAX_FILES)
+			return false;
+		if(index != prev + 1)
+			(*extents)++;
+		(*clusters)++;
+		prev = index;
+	}
+	return true;
+}
+
+/*
+* Prints how fragmented a list of files is.  The score is the share of steps
+* from one cluster of a file to the next that aren't to the adjacent 
+* cluster, so 0% means every file is contiguous.
+*/
+void printFragmentation(const char* label, frag_file* list, 
+		unsigned int count, unsigned int shared){
+	
+	// vars
+	unsigned long files = 0, fragmented = 0, extents = 0, clusters = 0;
+	
+	for(unsigned int i = 0; i < count; i++){
+		if(list[i].extents == 0)
+			continue;
+		files++;
+		fragmented += list[i].extents > 1;
+		extents += list[i].extents;
+		clusters += list[i].clusters;
+	}
+	
+	printf("%s: %lu of %lu files fragmented, %lu extents over %lu clusters "
+		"(score %.1f%%)", label, fragmented, files, extents, clusters,
+		clusters > files ? 100.0 * (extents - files) / (clusters - files)
+		: 0.0);
+	if(shared != 0)
+		printf(", %u shared file(s) left alone", shared);
+	printf("\n");
+}
+
+/*
+* Most fragmented files first.
+*/
+int compareFragments(const void* a, const void* b){
+	unsigned int x = ((frag_file*)a)->extents, y = ((frag_file*)b)->extents;
+	return x > y ? -1 : x < y;
+}
+
+void stopDefrag(int){
+	defrag_stop = 1;
+}
+
+/*
+* Checks the whole volume: every chain is walked, on as many threads as 
+* there are cores, claiming its clusters in an ownership map as it goes.  
+* That turns up entries pointing at free clusters, broken and looping 
+* chains, chains running into each other (unless both files are sharing 
+* clusters copy-on-write), and chains the wrong length for their size; a
+* second parallel pass finds clusters in use that nothing owns.
+*
+* @param	repair			fix what can be fixed: broken chains are cut, 
+*							sizes made to match, cross-linked files marked
+*							shared so a write splits them, and leaked 
+*							clusters freed
+*/
+void checkVolume(mbr* MBR, directory* dir_table, unsigned int* file_table,
+		volume* vol, bool repair){
+	
+	// vars
+	unsigned int count = 0, cap = 0, threads, found = 0, dirs = 0, 
+		reserved = 0, broken = 0, first_data = firstDataCluster(MBR);
+	unsigned long leaked = 0, clusters = 0, corrupt = 0;
+	fsck_item* items = NULL;
+	bool* seen = (bool*)calloc(MAX_FILES, sizeof(bool));
+	fsck_job job;
+	struct timeval start, end;
+	void* (*phases[])(void*) = {walkChains, findLeaks, verifySums};
+	int phase_count = sums.table != NULL ? 3 : 2;
+	
+	gettimeofday(&start, NULL);
+	
+	// the data gets checked straight off the image
+	if(sums.table != NULL)
+		flushClusterCache(vol);
+	
+	// the directories are read up front, through the cache
+	collectChains(MBR, dir_table, file_table, vol, MAX_FILES, &items, &count,
+		&cap, seen);
+	free(seen);
+	
+	// everything below the first data cluster belongs to the volume itself
+	for(unsigned int c = 0; c < first_data; c++)
+		reserved += file_table[c] != RESERVE_CLUSTER;
+	
+	// then the chains are walked and the leaks counted, a phase at a time
+	threads = sysconf(_SC_NPROCESSORS_ONLN) < 1 ? 1 
+		: sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads > FSCK_THREADS)
+		threads = FSCK_THREADS;
+	job.items = items;
+	job.count = count;
+	job.next = 0;
+	job.owner = (unsigned int*)malloc(sizeof(unsigned int) * MAX_FILES);
+	memset(job.owner, 0xFF, sizeof(unsigned int) * MAX_FILES);
+	job.file_table = file_table;
+	job.first_data = first_data;
+	job.threads = threads;
+	job.fd = vol->fd;
+	job.cluster_size = MBR->cluster_size;
+	
+	fsck_worker workers[threads];
+	bool started[threads];
+	for(int p = 0; p < phase_count; p++){
+		for(unsigned int t = 0; t < threads; t++){
+			workers[t].job = &job;
+			workers[t].id = t;
+			workers[t].leaked = 0;
+			workers[t].corrupt = 0;
+			started[t] = pthread_create(&workers[t].thread, NULL, phases[p],
+				&workers[t]) == 0;
+			if(!started[t])
+				phases[p](&workers[t]);
+		}
+		for(unsigned int t = 0; t < threads; t++)
+			if(started[t])
+				pthread_join(workers[t].thread, NULL);
+	}
+	for(unsigned int t = 0; t < threads; t++){
+		leaked += workers[t].leaked;
+		corrupt += workers[t].corrupt;
+	}
+	gettimeofday(&end, NULL);
+	
+	// report the first few problems in detail
+	for(unsigned int i = 0; i < count; i++){
+		fsck_item* item = &items[i];
+		clusters += item->clusters;
+		dirs += (item->entry.type & TYPE_MASK) == TYPE_DIRECTORY;
+		broken += (item->problems & ~FSCK_CHECKSUM) != 0;
+		if(item->problems == 0 || found++ >= 20)
+			continue;
+		printf("%s:", item->entry.name);
+		if(item->problems & FSCK_FREE)
+			printf(" points at a free cluster;");
+		if(item->problems & FSCK_HEADER)
+			printf(" isn't a valid directory;");
+		if(item->problems & FSCK_BROKEN)
+			printf(" chain breaks after cluster %u;", item->last_good);
+		if(item->problems & FSCK_LOOP)
+			printf(" chain loops after cluster %u;", item->last_good);
+		if(item->problems & FSCK_CROSS)
+			printf(" cross-linked with %s;", items[item->other].entry.name);
+		if((item->problems & FSCK_SIZE) && (item->entry.type & TYPE_INLINE))
+			printf(" inline data runs past its entry;");
+		else if(item->problems & FSCK_SIZE)
+			printf(" has %u clusters but needs %u;", item->clusters, 
+				item->expected);
+		if(item->problems & FSCK_CHECKSUM)
+			printf(" data doesn't match its checksums;");
+		printf("\n");
+	}
+	if(found > 20)
+		printf("... and %u more\n", found - 20);
+	printf("Checked %u files and %u directories (%lu clusters) on %u "
+		"thread(s) in %.3fs\n", count - dirs, dirs, clusters, threads,
+		(end.tv_sec - start.tv_sec) 
+		+ (end.tv_usec - start.tv_usec) / 1000000.0);
+	if(leaked != 0)
+		printf("%lu clusters are in use but belong to nothing\n", leaked);
+	if(reserved != 0)
+		printf("%u clusters of the volume's own area aren't reserved\n", 
+			reserved);
+	if(corrupt != 0)
+		printf("%lu clusters don't match their checksums\n", corrupt);
+	
+	// bad data can only be reported; everything else can be fixed
+	if(corrupt != 0)
+		printf("Data that doesn't match its checksums can't be repaired; "
+			"those files need copying in again\n");
+	if(broken == 0 && leaked == 0 && reserved == 0){
+		if(corrupt == 0)
+			printf("No problems found\n");
+	}
+	else if(!repair)
+		printf("Run fsck -r to repair them\n");
+	else{
+		
+		// repairs happen one at a time, with accurate reference counts;
+		// leaks go first, while the ownership map still describes the FAT
+		buildRefCounts(MBR, dir_table, file_table, vol);
+		for(unsigned int c = 0; c < MAX_FILES; c++){
+			if(c < first_data && file_table[c] != RESERVE_CLUSTER)
+				setFileTableEntry(file_table, c, RESERVE_CLUSTER);
+			else if(c >= first_data && job.owner[c] == EMPTY_SLOT 
+					&& file_table[c] != FREE_CLUSTER){
+				setFileTableEntry(file_table, c, FREE_CLUSTER);
+				invalidateCachedCluster(c);
+			}
+		}
+		for(unsigned int i = 0; i < count; i++)
+			if(items[i].problems & ~FSCK_CHECKSUM)
+				repairChain(MBR, dir_table, file_table, vol, items, &items[i]);
+		buildRefCounts(MBR, dir_table, file_table, vol);
+		commitTables(vol, MBR, dir_table, file_table);
+		printf("Repaired\n");
+	}
+	
+	free(job.owner);
+	free(items);
+}
+
+/*
+* Lists every chain the checker has to walk: each file's, and each 
+* subdirectory's own blocks, below the given directory.
+*
+* @param	dir				the directory's first cluster (MAX_FILES for the
+*							root)
+* @param	seen			directories already listed, so one that shows up
+*							twice (or inside itself) is only walked once
+*/
+void collectChains(mbr* MBR, directory* dir_table, unsigned int* file_table,
+		volume* vol, unsigned int dir, fsck_item** list, unsigned int* count,
+		unsigned int* cap, bool* seen){
+	
+	// vars
+	dir_reader reader;
+	directory* next;
+	fsck_item item;
+	
+	memset(&item, 0, sizeof(fsck_item));
+	item.ref.dir = dir;
+	if(dir != MAX_FILES)
+		openDirectory(MBR, vol, &reader, dir);
+	
+	for(unsigned int slot = 0; ; slot++){
+		if(dir == MAX_FILES){
+			if(slot == MAX_FILES)
+				break;
+			item.entry = dir_table[slot];
+			if(item.entry.name[0] == 0x00 
+					|| (unsigned char)item.entry.name[0] == DELETED_FILE)
+				continue;
+			item.ref.slot = slot;
+		}
+		else{
+			next = nextDirectoryEntry(MBR, file_table, vol, &reader);
+			if(next == NULL)
+				break;
+			item.entry = *next;
+			item.ref.slot = reader.slot;
+		}
+		item.problems = 0;
+		
+		// a file needs a cluster per cluster_size bytes (at least one); a
+		// directory as many as its header says
+		if(item.entry.type & TYPE_INLINE)
+			item.expected = 0;
+		else if((item.entry.type & TYPE_MASK) != TYPE_DIRECTORY)
+			item.expected = item.entry.size == 0 ? 1 
+				: (item.entry.size - 1) / MBR->cluster_size + 1;
+		else if(isClusterLink(item.entry.index) && !seen[item.entry.index]){
+			char block[MBR->cluster_size];
+			seen[item.entry.index] = true;
+			readDirectoryBlock(MBR, item.entry.index, block, vol);
+			if(((dir_header*)block)->magic != DIR_MAGIC
+					&& ((dir_header*)block)->magic != DIR_SLACK_MAGIC)
+				item.problems = FSCK_HEADER;
+			else{
+				item.expected = directoryBlocks(MBR, block);
+				collectChains(MBR, dir_table, file_table, vol, 
+					item.entry.index, list, count, cap, seen);
+			}
+		}
+		
+		if(*count == *cap){
+			*cap = *cap == 0 ? 64 : *cap * 2;
+			*list = (fsck_item*)realloc(*list, sizeof(fsck_item) * *cap);
+		}
+		(*list)[(*count)++] = item;
+	}
+	if(dir != MAX_FILES)
+		free(reader.buf);
+}
+
+/*
+* Checker thread: takes chains off the list until there are none left, and
+* walks each one, claiming its clusters.  A cluster some other chain got to
+* first is a cross-link, one this chain already claimed means it loops.
+*/
+void* walkChains(void* arg){
+	
+	// vars
+	fsck_job* job = ((fsck_worker*)arg)->job;
+	unsigned int* table = job->file_table;
+	unsigned int i, c, next, prev, claimed;
+	
+	while((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) 
+			< job->count){
+		fsck_item* item = &job->items[i];
+		
+		// an inline file has no chain, only data that has to fit its entry
+		if(item->entry.type & TYPE_INLINE){
+			if(!fitsInline(item->entry.name, item->entry.size))
+				item->problems |= FSCK_SIZE;
+			continue;
+		}
+		
+		c = prev = item->entry.index;
+		if(!isClusterLink(c) || c < job->first_data 
+				|| table[c] == FREE_CLUSTER){
+			item->problems |= FSCK_FREE;
+			continue;
+		}
+		
+		while(true){
+			claimed = EMPTY_SLOT;
+			if(!__atomic_compare_exchange_n(&job->owner[c], &claimed, i, 
+					false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				if(claimed == i){
+					item->problems |= FSCK_LOOP;
+					item->last_good = prev;
+					break;
+				}
+				if(!(item->entry.type & job->items[claimed].entry.type 
+						& TYPE_SHARED) && !(item->problems & FSCK_CROSS)){
+					item->problems |= FSCK_CROSS;
+					item->other = claimed;
+				}
+			}
+			item->clusters++;
+			
+			next = table[c];
+			if(next == LAST_CLUSTER)
+				break;
+			if(!isClusterLink(next) || next < job->first_data 
+					|| table[next] == FREE_CLUSTER){
+				item->problems |= FSCK_BROKEN;
+				item->last_good = c;
+				break;
+			}
+			
+			// a loop entirely inside someone else's chain never comes back
+			// to one of ours; no chain is longer than the volume, though
+			if(item->clusters == MAX_FILES){
+				item->problems |= FSCK_LOOP;
+				item->last_good = c;
+				break;
+			}
+			prev = c;
+			c = next;
+		}
+		
+		if(!(item->problems & (FSCK_LOOP | FSCK_BROKEN | FSCK_HEADER))
+				&& item->clusters != item->expected)
+			item->problems |= FSCK_SIZE;
+	}
+	return NULL;
+}
+
+/*
+* Checker thread: counts clusters in its share of the volume that are in
+* use without any chain having claimed them.
+*/
+void* findLeaks(void* arg){
+	
+	// vars
+	fsck_worker* worker = (fsck_worker*)arg;
+	fsck_job* job = worker->job;
+	unsigned int per = (MAX_FILES - job->first_data + job->threads - 1) 
+		/ job->threads, from = job->first_data + worker->id * per,
+		to = from + per < MAX_FILES ? from + per : MAX_FILES;
+	
+	for(unsigned int c = from; c < to; c++)
+		if(job->file_table[c] != FREE_CLUSTER && job->owner[c] == EMPTY_SLOT)
+			worker->leaked++;
+	return NULL;
+}
+
+/*
+* Checker thread: reads the clusters in its share of the volume that some
+* chain claimed and checks them against their checksums, a run of them at a
+* time.  A bad cluster is blamed on the chain that owns it.
+*/
+void* verifySums(void* arg){
+	
+	// vars
+	fsck_worker* worker = (fsck_worker*)arg;
+	fsck_job* job = worker->job;
+	unsigned int per = (MAX_FILES - job->first_data + job->threads - 1) 
+		/ job->threads, from = job->first_data + worker->id * per,
+		to = from + per < MAX_FILES ? from + per : MAX_FILES,
+		size = job->cluster_size, most = COPY_CHUNK / size, run;
+	char* buf;
+	
+	if(most == 0)
+		most = 1;
+	buf = (char*)malloc((size_t)most * size);
+	for(unsigned int c = from; c < to; c += run){
+		if(job->owner[c] == EMPTY_SLOT || sums.table[c] == 0){
+			run = 1;
+			continue;
+		}
+		for(run = 1; run < most && c + run < to 
+				&& job->owner[c + run] != EMPTY_SLOT 
+				&& sums.table[c + run] != 0; run++)
+			;
+		if(pread(job->fd, buf, (size_t)run * size, (off_t)c * size) 
+				!= (ssize_t)run * size)
+			continue;
+		for(unsigned int k = 0; k < run; k++){
+			if(crc32c(buf + (size_t)k * size, size) == sums.table[c + k])
+				continue;
+			worker->corrupt++;
+			__atomic_fetch_or(&job->items[job->owner[c + k]].problems, 
+				FSCK_CHECKSUM, __ATOMIC_RELAXED);
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+/*
+* Fixes what the checker found wrong with one chain, as far as it can be 
+* fixed: an entry with nothing usable left starts over empty, a broken or
+* looping chain ends at its last good cluster, and the chain and the size
+* are made to agree by cutting whichever is longer.
+*/
+void repairChain(mbr* MBR, directory* dir_table, unsigned int* file_table, 
+		volume* vol, fsck_item* items, fsck_item* item){
+	
+	// vars
+	directory* entry = &item->entry;
+	bool is_dir = (entry->type & TYPE_MASK) == TYPE_DIRECTORY;
+	unsigned int length = 0, keep, tail, rest, old;
+	
+	// an inline file just loses whatever its size claims past the entry
+	if(entry->type & TYPE_INLINE){
+		entry->size = inlineRoom(entry->name);
+		storeEntry(MBR, dir_table, file_table, vol, item->ref, entry);
+		return;
+	}
+	
+	if(item->problems & (FSCK_FREE | FSCK_HEADER)){
+		old = entry->index;
+		entry->index = is_dir ? newDirectoryBlocks(MBR, file_table) 
+			: findFreeCluster(MBR, file_table);
+		if(entry->index == MAX_FILES){
+			fprintf(stderr, "Sorry, no room left to repair %s!\n", 
+				entry->name);
+			return;
+		}
+		if(!is_dir)
+			setFileTableEntry(file_table, entry->index, LAST_CLUSTER);
+		ref_counts[entry->index]++;
+		entry->size = 0;
+		storeEntry(MBR, dir_table, file_table, vol, item->ref, entry);
+		if((item->problems & FSCK_HEADER) && isClusterLink(old)){
+			ref_counts[old]--;
+			releaseChain(file_table, old);
+		}
+		return;
+	}
+	
+	if(item->problems & (FSCK_BROKEN | FSCK_LOOP))
+		setFileTableEntry(file_table, item->last_good, LAST_CLUSTER);
+	
+	// files running into each other now share clusters copy-on-write;
+	// directories can't
+	if(item->problems & FSCK_CROSS){
+		fsck_item* other = &items[item->other];
+		if(is_dir || (other->entry.type & TYPE_MASK) == TYPE_DIRECTORY)
+			fprintf(stderr, "Sorry, %s and %s can't be untangled!\n", 
+				entry->name, other->entry.name);
+		else{
+			entry->type |= TYPE_SHARED;
+			other->entry.type |= TYPE_SHARED;
+			storeEntry(MBR, dir_table, file_table, vol, other->ref, 
+				&other->entry);
+		}
+	}
+	
+	// cut the chain down to the size, or the size down to the chain
+	for(unsigned int c = entry->index; isClusterLink(c) && length < MAX_FILES;
+			c = file_table[c])
+		length++;
+	keep = length < item->expected ? length : item->expected;
+	if(keep == 0)
+		keep = 1;
+	if(length > keep){
+		tail = entry->index;
+		for(unsigned int k = 1; k < keep; k++)
+			tail = file_table[tail];
+		rest = file_table[tail];
+		setFileTableEntry(file_table, tail, LAST_CLUSTER);
+		releaseChain(file_table, rest);
+	}
+	if(!is_dir && (size_t)keep * MBR->cluster_size < entry->size)
+		entry->size = keep * MBR->cluster_size;
+	if(is_dir){
+		char block[MBR->cluster_size];
+		readDirectoryBlock(MBR, entry->index, block, vol);
+		if(directoryBlocks(MBR, block) != keep)
+			setDirectoryBlocks(MBR, vol, entry->index, keep);
+	}
+	
+	storeEntry(MBR, dir_table, file_table, vol, item->ref, entry);
+}
+
+bool createFile(char* name, directory* dir_table, mbr* MBR, volume* vol, 
+	unsigned int* file_table){
 	
-	// prep for reading
-	unsigned int i = 0;
-	unsigned int readOff = cluster_size;
-	writeIndex = findFreeCluster(MBR, file_table);
-	prevIndex = writeIndex;
-	dir_table[dir_index].index = writeIndex; // set this since we have it now
-	memset(buf, 0, cluster_size);
+	// vars
+	unsigned int dir;
+	char* leaf;
+	directory entry;
+	
+	// find the directory the file goes in
+	if(!findParent(MBR, dir_table, file_table, vol, name, &dir, &leaf)){
+		fprintf(stderr, "Sorry, there's no directory to put %s in!\n", name);
+		return false;
+	}
+	
+	// a new file is empty, so it starts out inline with no cluster at all
+	memset(&entry, 0, sizeof(directory));
+	entry.index = LAST_CLUSTER;
+	entry.size = 0;
+	entry.type = TYPE_FILE | TYPE_INLINE;
+	entry.timestamp = time(NULL);
+	
+	// names must fit in the entry and be unique
+	return addEntry(MBR, dir_table, file_table, vol, dir, leaf, &entry);
+}
+
+void printFile(mbr * MBR, unsigned int * file_table, directory * dir_table,
+		char* filename, volume* filesystem){
+	
+	// vars
+	entry_ref ref;
+	directory entry;
+	if(!findEntry(MBR, dir_table, file_table, filesystem, filename, &ref, 
+			&entry)){
+		fprintf(stderr, "Sorry, that file doesn't seem to exist!\n");
+		return;
+	}
+	if((entry.type & TYPE_MASK) != TYPE_FILE){
+		fprintf(stderr, "Sorry, %s is a directory!\n", filename);
+		return;
+	}
+	
+	// a compressed file gets unpacked on its way out, and an inline one is
+	// written straight from its entry without touching a cluster
+	if(entry.type & (TYPE_COMPRESSED | TYPE_INLINE)){
+		cout.flush();
+		fflush(stdout);
+		if(entry.type & TYPE_COMPRESSED)
+			unpackFile(MBR, file_table, filesystem, &entry, STDOUT_FILENO, 
+				false);
+		else if(!fitsInline(entry.name, entry.size))
+			fprintf(stderr, "Woah! %s is corrupt!\n", filename);
+		else
+			writeFully(STDOUT_FILENO, inlineData(&entry), entry.size);
+		if(isatty(STDOUT_FILENO))
+			cout << endl;
+		return;
+	}
+	unsigned int read_index = entry.index,
+		cluster_size = MBR->cluster_size, clusters, run, next;
+	size_t size = entry.size, bytes;
+	bool terminal = isatty(STDOUT_FILENO);
+	char buf[cluster_size];
+	
+	// anything cout is holding has to go out ahead of the file
+	cout.flush();
+	fflush(stdout);
 	
-	// read so long as we have data left!
-	while(size != 0){
+	// a terminal goes through the cluster cache; anything else gets each
+	// contiguous run handed over by the kernel, so the image has to be 
+	// current first
+	if(!terminal)
+		flushClusterCache(filesystem);
 	
-		if(size > cluster_size)
-			size -= cluster_size;
+	// read in all linked clusters, a run of adjacent ones at a time
+	while(size != 0 && read_index < MAX_FILES){
+		clusters = (size + cluster_size - 1) / cluster_size;
+		run = chainRunLength(MBR, file_table, read_index, clusters, &next);
+		bytes = (size_t)run * cluster_size;
+		if(bytes > size)
+			bytes = size;
+		
+		if(!terminal){
+			if(!sendClusters(MBR, filesystem, STDOUT_FILENO, read_index, 
+					bytes)){
+				fprintf(stderr, "Whoops! Couldn't print all of %s!\n", 
+					filename);
+				return;
+			}
+		}
 		else{
-			readOff = size;
-			size = 0;
+			for(size_t done = 0; done < bytes; done += cluster_size){
+				unsigned int len = bytes - done < cluster_size ? 
+					bytes - done : cluster_size;
+				if(!readCluster(MBR, buf, read_index + done / cluster_size, 
+						len, filesystem)){
+					fprintf(stderr, "\nWhoops! Couldn't print all of %s!\n", 
+						filename);
+					return;
+				}
+				writeFully(STDOUT_FILENO, buf, len);
+			}
 		}
 		
-		file_table[prevIndex] = writeIndex;
-		prevIndex = writeIndex;
-		
-		// read from host fs
-		fseek(host_file, cluster_size*i, SEEK_SET);
-		fread(buf, sizeof(char), readOff, host_file);
-		
-		// write to virtual filesystem
-		writeCluster(MBR, writeIndex, buf, filesystem);
-		filesystem = fopen(fsname, "r+");
-		
-		// prep for next read
-		writeIndex = findFreeCluster(MBR, file_table);
-		i++;
+		size -= bytes;
+		read_index = next;
 	}
 	
-	file_table[prevIndex] = LAST_CLUSTER;
+	// keep the prompt off the end of the file
+	if(terminal)
+		cout << endl;
+}
 	
+
+/*
+* Finds the lowest numbered free cluster without walking the FAT; the free
+* bitmap is searched a word at a time starting from the next-free hint.
+*
+* @returns				the index of a free cluster, or the total number of
+*						clusters if the disk is full
+*/
+unsigned int findFreeCluster(mbr * MBR, unsigned int *){
+	unsigned int MAX_FILES = clusterCount(MBR),
+		words = (MAX_FILES + 31) / 32,
+		start = free_hint < MAX_FILES ? free_hint : 0,
+		w = start / 32;
 	
-	// lastly, write the tables to disk!
-	updateFileTable(filesystem, MBR, file_table);
-	filesystem = fopen(fsname, "r+");
-	updateDirectoryTable(filesystem, MBR, dir_table);
-	filesystem = fopen(fsname, "r+");
+	// out of room: wait for the committed clusters still being punched.
+	// Ones freed by changes that aren't committed yet stay held; reusing 
+	// them is exactly what a crash mustn't see
+	if(free_count == 0 && holes.waiting != 0)
+		collectHoles(true);
+	
+	if(free_count == 0)
+		return MAX_FILES;
+	
+	// the first word is visited twice; the first time ignore everything
+	// below the hint, the second time (after wrapping) take anything
+	for(unsigned int i = 0; i <= words; i++){
+		unsigned int bits = free_map[w];
+		if(i == 0)
+			bits &= ~0u << (start % 32);
+		if(bits != 0)
+			return w * 32 + __builtin_ctz(bits);
+		w = (w + 1) % words;
+	}
+	
+	return MAX_FILES;
 }
 
-void readCluster(mbr* MBR, char* buf, unsigned int index, unsigned int size, FILE* fp){
-	
-	// vars
-	unsigned int csize = MBR->cluster_size;
-	unsigned int loc = csize*index;
+unsigned int findFreeDirEntry(mbr* MBR, directory* dir_table){
+	unsigned int MAX_FILES = clusterCount(MBR),
+		dir_index = 0;
+	while(dir_index != MAX_FILES && dir_table[dir_index].name[0] != FREE_CLUSTER
+			&& (unsigned char)dir_table[dir_index].name[0] != DELETED_FILE)
+			dir_index++;
 	
-	// read the data from the filesystem
-	fseek(fp, loc, SEEK_SET);
-	fread(buf, sizeof(char), size, fp);
+	return dir_index;
 }
 
-void writeCluster(mbr* MBR, unsigned int index, char* buf, FILE* fp){
+/*
+* Claims a run of contiguous free clusters and chains them together; the
+* last one is marked LAST_CLUSTER.  The first run long enough is used, or
+* failing that the longest one there is; but not before waiting for any 
+* committed clusters that are still being punched, which may be what a 
+* long enough run is missing.
+*
+* @param	MBR				the filesystem's master boot record
+* @param	file_table		the in-memory FAT
+* @param	want			how many clusters the caller would like
+* @param	start			receives the first cluster of the run
+*
+* @returns				the length of the run (0 if the disk is full)
+*/
+unsigned int allocateRun(mbr* MBR, unsigned int* file_table, 
+		unsigned int want, unsigned int* start){
 	
 	// vars
-	unsigned int cluster_size = MBR->cluster_size;
-	unsigned int loc = cluster_size*index;
+	unsigned int MAX_FILES = clusterCount(MBR), i, best, best_len, len;
+	bool waited = false;
+	
+	while(true){
+		i = findFreeCluster(MBR, file_table);
+		best = best_len = 0;
+		
+		// hop from free run to free run, skipping whole words of used 
+		// clusters
+		while(i < MAX_FILES && best_len < want){
+			if(!(free_map[i / 32] & (1u << (i % 32)))){
+				if(i % 32 == 0 && free_map[i / 32] == 0)
+					i += 32;
+				else
+					i++;
+				continue;
+			}
+			for(len = 0; i + len < MAX_FILES && len < want 
+					&& (free_map[(i + len) / 32] & (1u << ((i + len) % 32)));
+					len++);
+			if(len > best_len){
+				best = i;
+				best_len = len;
+			}
+			i += len;
+		}
+		
+		// settle for a shorter run only once nothing committed is still 
+		// on its way back
+		if(best_len >= want || waited || holes.waiting == holes.held_len)
+			break;
+		collectHoles(true);
+		waited = true;
+	}
+	if(best_len == 0)
+		return 0;
 	
-	cerr << buf << endl;
+	// claim the clusters back to front so each links to the next
+	setFileTableEntry(file_table, best + best_len - 1, LAST_CLUSTER);
+	for(len = best_len - 1; len > 0; len--)
+		setFileTableEntry(file_table, best + len - 1, best + len);
 	
-	// write to our filesystem
-	fseek(fp, loc, SEEK_SET);
-	int r = fwrite(buf, sizeof(char), cluster_size, fp);
-	cerr << r;
-	fflush(fp);
-	fflush(NULL);
-	fclose(fp);
+	*start = best;
+	return best_len;
 }
 
-void readIntoBuffer(char* src, unsigned int size, FILE* fp){
-
+/*
+* Returns the number of unallocated clusters, which the allocator keeps up to
+* date as the FAT changes.  Committed clusters it is still holding back count;
+* it waits for them rather than run out.  Ones freed since the last commit 
+* don't, as it won't hand them out before then.
+*/
+unsigned int findTotalFreeClusterCount(){
+	return free_count + holes.waiting - holes.held_len;
 }
 
 /*
-* Returns the size of a given file
-* Source: 7
+* Returns the first cluster past the MBR, directory table, FAT and journal; 
+* nothing
+* below it may ever be handed out for file data.
 */
-off_t fsize(const char *filename) {
-    struct stat st; 
-
-    if (stat(filename, &st) == 0)
-        return st.st_size;
-
-    return -1; 
+unsigned int firstDataCluster(mbr* MBR){
+	unsigned int MAX_FILES = clusterCount(MBR),
+		cluster_size = MBR->cluster_size,
+		dir_end = MBR->dir_table_index + (MAX_FILES * sizeof(directory) 
+			+ cluster_size - 1) / cluster_size,
+		fat_end = MBR->FAT_index + (MAX_FILES * sizeof(unsigned int) 
+			+ cluster_size - 1) / cluster_size;
+	
+	// so is the journal, if there is one
+	if(MBR->magic == JOURNAL_MAGIC 
+			&& MBR->journal_index + MBR->journal_clusters > fat_end)
+		fat_end = MBR->journal_index + MBR->journal_clusters;
+	
+	// and the checksum table
+	if(hasChecksums(MBR) && MBR->checksum_index + (MAX_FILES 
+			* sizeof(unsigned int) + cluster_size - 1) / cluster_size 
+			> fat_end)
+		fat_end = MBR->checksum_index + (MAX_FILES * sizeof(unsigned int) 
+			+ cluster_size - 1) / cluster_size;
+	
+	return dir_end > fat_end ? dir_end : fat_end;
 }
 
+/*
+* True for filesystems with a cluster checksum table; only v2 images made 
+* since it was added have one.
+*/
+bool hasChecksums(mbr* MBR){
+	return isFormatV2(MBR) && MBR->checksum_index != 0;
+}
 
-unsigned int findDirectoryIndexOfFile(directory* files, char* filename){
+/*
+* True for filesystems in the v2 format; anything else is read the original
+* way.  The original MBR was followed by junk, so the journal magic has to
+* match too.
+*/
+bool isFormatV2(mbr* MBR){
+	return MBR->magic == JOURNAL_MAGIC && MBR->version == FORMAT_V2;
+}
 
-	// vars
-	unsigned int index = 0;
+/*
+* Returns how many clusters (and so FAT and directory entries) the 
+* filesystem has.
+*/
+unsigned int clusterCount(mbr* MBR){
+	if(isFormatV2(MBR))
+		return MBR->cluster_count;
+	return MBR->disk_size / MBR->cluster_size;
+}
 
-	while(index < MAX_FILES){	
-		if(strncmp(files[index].name, filename, strlen(filename)) == 0){
-			return index;
-		}
-		index++;
-	}
-	
-	return 0;
+/*
+* Returns the size of the whole filesystem, in bytes.
+*/
+off_t diskSize(mbr* MBR){
+	return (off_t)clusterCount(MBR) * MBR->cluster_size;
 }
 
-void deleteFile(directory* files, unsigned int* file_table, int index){
-	
-	// mark the file deleted
-	files[index].name[0] = 0xFF;
+/*
+* Picks the FAT markers for the filesystem's format.  The original format's
+* 16-bit markers cap it at 65534 clusters; v2 moves them to the top of the
+* 32-bit range.
+*/
+void setFormat(mbr* MBR){
+	if(isFormatV2(MBR)){
+		RESERVE_CLUSTER = 0xFFFFFFFE;
+		LAST_CLUSTER = 0xFFFFFFFF;
+	}
+	else{
+		RESERVE_CLUSTER = 0xFFFE;
+		LAST_CLUSTER = 0xFFFF;
+	}
 }
 
 /*
-* Just prints that a process we had forked and ran in the background finished 
-* running and has exited.
+* Builds the free-cluster bitmap from the FAT.  Older disks only reserved the
+* first few clusters even though the directory table runs past them, so any
+* metadata cluster the FAT thinks is free gets reserved here.
 *
-* @param	childPID		the process ID of the process that just exit
+* @param	MBR				the filesystem's master boot record
+* @param	file_table		the in-memory FAT
 */
-void processTerminated(int childPID){
+void buildFreeMap(mbr* MBR, unsigned int* file_table){
 	
-	// don't print termination messages if the process didn't come from a 
-	// forked background process
-	if(childPID > 0)
-		cout << "Child Process terminated: " << childPID << endl;
-}
-
-int checkFSIntegrity(mbr * MBR){
+	// vars
+	unsigned int MAX_FILES = clusterCount(MBR),
+		reserved = firstDataCluster(MBR);
 	
-	int problemsFound = 0;
+	free(free_map);
+	free_map = (unsigned int*)calloc((MAX_FILES + 31) / 32, 
+		sizeof(unsigned int));
+	free_count = 0;
+	free_hint = MAX_FILES;
 	
-	if(MBR->cluster_size < 8 * KILOBYTE){
-		cerr << "Looks like this filesystem's cluster size is really " 
-				"small!\n This could cause problems with reading/writing "
-				"files.\n";
-		problemsFound++;
-	}
-	else if(MBR->cluster_size > 16 * KILOBYTE){
-		cerr << "This filesystem uses an abnormally large cluster size;\n"
-				"this shouldn't cause problems, however.\n";
-		problemsFound++;
+	for(unsigned int i = 0; i < MAX_FILES; i++){
+		if(i < reserved && file_table[i] == FREE_CLUSTER){
+			file_table[i] = RESERVE_CLUSTER;
+			markDirty(&fat_dirty, (size_t)i * sizeof(unsigned int), 
+				sizeof(unsigned int));
+		}
+		if(file_table[i] == FREE_CLUSTER){
+			free_map[i / 32] |= 1u << (i % 32);
+			free_count++;
+			if(free_hint == MAX_FILES)
+				free_hint = i;
+		}
 	}
+}
+
+/*
+* Changes a single FAT entry, keeping the free bitmap, free count, next-free
+* hint, reference counts and checksums in step with it.  All FAT updates should go 
+* through here.
+*
+* @param	file_table		the in-memory FAT
+* @param	index			the cluster whose entry is changing
+* @param	value			the new entry (next cluster, or one of the
+*							FREE/LAST/RESERVE markers)
+*/
+void setFileTableEntry(unsigned int* file_table, unsigned int index, 
+		unsigned int value){
 	
-	if(MBR->disk_size < 5 * MEGABYTE){
-		cerr << "Warning! This filesystem is unusually small! This is not "
-				"necessarily a problem, but should be made bigger.\n";
-		problemsFound++;
-	}
-	else if(MBR->disk_size > 50 * MEGABYTE){
-		cerr << "This filesystem is abnormally large in size;\n"
-				"this shouldn't cause problems, however.\n";
-		problemsFound++;
-	}
+	bool was_free = file_table[index] == FREE_CLUSTER;
 	
-	if(MBR->FAT_index < 1){
-		cerr << "The filesystem's FAT appears to be in a non-standard"
-				" location!\n";
-		problemsFound++;
-	}
-	if(MBR->dir_table_index < 1){
-		cerr << "The filesystem's directory table appears to be in a"
-				"non-standard location!\n";
-		problemsFound++;
+	// the cluster we used to link to loses a reference, the new one gains it
+	if(ref_counts != NULL){
+		if(isClusterLink(file_table[index]))
+			ref_counts[file_table[index]]--;
+		if(isClusterLink(value))
+			ref_counts[value]++;
 	}
+	file_table[index] = value;
+	markDirty(&fat_dirty, (size_t)index * sizeof(unsigned int), 
+		sizeof(unsigned int));
 	
-	if(MBR->dir_table_index == MBR->FAT_index){
-		cerr << "The filesystem's FAT and directory table appear to be"
-				" in the same location!\n";
-		problemsFound++;
+	// a newly allocated cluster still holds whatever was there before, and
+	// has no checksum until it's written
+	if(was_free && value != FREE_CLUSTER){
+		free_map[index / 32] &= ~(1u << (index % 32));
+		free_count--;
+		if(index == free_hint)
+			free_hint++;
+		if(sums.table != NULL && sums.table[index] != 0){
+			sums.table[index] = 0;
+			markDirty(&sum_dirty, (size_t)index * sizeof(unsigned int), 
+				sizeof(unsigned int));
+		}
+	}
+	else if(!was_free && value == FREE_CLUSTER){
+		free_map[index / 32] |= 1u << (index % 32);
+		free_count++;
+		if(index < free_hint)
+			free_hint = index;
 	}
-	
-	return problemsFound;
 }
 
 /*
-* Resets all characters of a given char array to nul-bytes
-*
-* @param	buf				character array to be cleaned up
+* True if a FAT entry (or directory index) points at a real cluster rather
+* than holding one of the FREE/LAST/RESERVE markers.
 */
-void resetBuf(char* buf){
-	memset(buf, 0, strlen(buf));
+bool isClusterLink(unsigned int value){
+	return value != FREE_CLUSTER && value < MAX_FILES;
 }
 
-void updateFileTable(FILE* fp, mbr* MBR, unsigned int* file_table){
+/*
+* Counts the references to every cluster: one for each FAT entry linking to
+* it, plus one for each file starting at it.  A cluster reachable from more
+* than one file therefore has a count above one somewhere on the way to it.
+*
+* @param	MBR				the filesystem's master boot record
+* @param	dir_table		the in-memory directory table
+* @param	file_table		the in-memory FAT
+*/
+void buildRefCounts(mbr* MBR, directory* dir_table, unsigned int* file_table,
+		volume* vol){
 	
 	// vars
-	unsigned int fat_index = MBR->FAT_index;
-	unsigned int cluster_size = MBR->cluster_size;
+	unsigned int MAX_FILES = clusterCount(MBR);
 	
-	// write the modified FAT to the disk
-	fseek(fp, fat_index * cluster_size, SEEK_SET);
-	fwrite(file_table, sizeof(unsigned int), sizeof(file_table), fp);
-	fclose(fp);
-}
-
-void updateDirectoryTable(FILE* fp, mbr* MBR, directory* dir_table){
-
-	// vars
-	unsigned int dir_index = MBR->dir_table_index;
-	unsigned int cluster_size = MBR->cluster_size;
-	unsigned int MAX_FILES = MBR->disk_size / MBR->cluster_size;
+	free(ref_counts);
+	ref_counts = (unsigned int*)calloc(MAX_FILES, sizeof(unsigned int));
 	
-	// write the modified FAT to the disk
-	fseek(fp, dir_index * cluster_size, SEEK_SET);
-	fwrite(dir_table, sizeof(directory), MAX_FILES, fp);
-	fclose(fp);
+	for(unsigned int i = 0; i < MAX_FILES; i++){
+		if(isClusterLink(file_table[i]))
+			ref_counts[file_table[i]]++;
+		if(dir_table[i].name[0] != 0x00 
+				&& (unsigned char)dir_table[i].name[0] != DELETED_FILE
+				&& isClusterLink(dir_table[i].index)){
+			ref_counts[dir_table[i].index]++;
+			if((dir_table[i].type & TYPE_MASK) == TYPE_DIRECTORY)
+				countDirectoryRefs(MBR, file_table, vol, dir_table[i].index);
+		}
+	}
 }
 
 /*
-* Prints all files currently on the disk
+* Makes sure the cluster at some position of a file belongs to that file
+* alone before it gets written, splitting it off if it is shared.  Splitting 
+* has to work front to back: once a cluster is replaced, its successor gains
+* a reference from the copy, so it shows up as shared in turn.
 *
-* Time formatting came from Source: 6
+* @param	entry			the file's entry; the caller writes it back
+* @param	prev			the file's previous cluster (already private), or
+*							MAX_FILES if cur is the first one
+* @param	cur				the cluster about to be written
+* @param	copy			copy the old contents across; not needed if the
+*							caller is about to overwrite the whole cluster
+*
+* @returns				the cluster to write to
 */
-void printDirectoryTree(mbr* MBR, directory* dir_table){
+unsigned int unshareCluster(mbr* MBR, unsigned int* file_table, 
+		directory* entry, unsigned int prev, unsigned int cur, bool copy, 
+		volume* vol){
 	
-	// vars 
-	unsigned int index = 0;
-	unsigned int MAX_FILES = MBR->disk_size / MBR->cluster_size;
-	time_t raw;
-	struct tm * timeinfo;
-	char time[80];
-	char *type;
-	if(dir_table[index].type == 0)
-		type = "File";
-	else
-		type = "Directory";
+	// vars
+	unsigned int copy_index;
+	char buf[MBR->cluster_size];
 	
-	// loop through all files
-	while(index < MAX_FILES){
-		if(dir_table[index].name[0] != 0x00 && dir_table[index].name[0] != 0xFF){
-			
-			// format the time
-			raw = dir_table[index].timestamp;
-			timeinfo = localtime(&raw);
-			strftime(time, 80, "%B %d, %Y %X",timeinfo);
-		
-			// print the file meta-data
-			cout << dir_table[index].name << " " << dir_table[index].size 
-				<< "B" << " Cluster #: " << dir_table[index].index 
-				<< " Type: " << type 
-				<< " @ " << time << endl;
-		}
-		index++;
+	if(ref_counts[cur] <= 1)
+		return cur;
+	
+	// the copy continues on to wherever the original did
+	copy_index = findFreeCluster(MBR, file_table);
+	setFileTableEntry(file_table, copy_index, file_table[cur]);
+	// a bad cluster is copied as it is, and keeps its checksum so the copy
+	// doesn't pass for good
+	if(copy){
+		bool ok = readCluster(MBR, buf, cur, MBR->cluster_size, vol);
+		writeCluster(MBR, copy_index, buf, vol);
+		if(!ok && sums.table != NULL)
+			sums.table[copy_index] = sums.table[cur];
+	}
+	
+	// and takes the original's place in this file
+	if(prev == MAX_FILES){
+		ref_counts[cur]--;
+		ref_counts[copy_index]++;
+		entry->index = copy_index;
 	}
+	else
+		setFileTableEntry(file_table, prev, copy_index);
+	
+	return copy_index;
 }
 
-void showFileSystemStructure(unsigned int* file_table, mbr* MBR){
+/*
+* Drops a reference to a chain (after whatever pointed at it has been 
+* changed): clusters nothing refers to any more are freed, stopping at the
+* first one still in use elsewhere.  They go back to the allocator once the
+* commit is done with them.
+*/
+void releaseChain(unsigned int* file_table, unsigned int index){
 	
 	// vars
-	int i = 0, k = 0;
-	unsigned int MAX_FILES = MBR->disk_size / MBR->cluster_size;
+	unsigned int next;
 	
-	while(i < MAX_FILES-1){
-		cout << "Cluster: " << i;
-		k = file_table[i];
-		while(k != LAST_CLUSTER && k != 0 && k != RESERVE_CLUSTER){
-			cout << " -> " << k;
-			k = file_table[k];
-		}
-		i++;
-		cout << endl;
+	while(isClusterLink(index) && ref_counts[index] == 0){
+		next = file_table[index];
+		setFileTableEntry(file_table, index, FREE_CLUSTER);
+		invalidateCachedCluster(index);
+		forgetDirectoryBlock(index);
+		holdCluster(index);
+		index = next;
 	}
 }
 
-bool createFile(char* name, directory* dir_table, mbr* MBR, FILE* fp, 
-	unsigned int* file_table){
+/*
+* Keeps a just-freed cluster away from the allocator until the next commit.
+* Its FAT entry already says free; only the free map pretends otherwise.
+*/
+void holdCluster(unsigned int index){
+	if(holes.held_len == holes.held_cap){
+		holes.held_cap = holes.held_cap == 0 ? 256 : holes.held_cap * 2;
+		holes.held = (unsigned int*)realloc(holes.held, 
+			sizeof(unsigned int) * holes.held_cap);
+	}
+	holes.held[holes.held_len++] = index;
+	free_map[index / 32] &= ~(1u << (index % 32));
+	free_count--;
+	holes.waiting++;
+	holes.freed++;
+}
+
+/*
+* Hands a held cluster back to the allocator.
+*/
+void releaseHold(unsigned int index){
+	free_map[index / 32] |= 1u << (index % 32);
+	free_count++;
+	if(index < free_hint)
+		free_hint = index;
+	holes.waiting--;
+}
+
+/*
+* Called once a commit is durable: the clusters it freed can be reused, or
+* with punching on, are passed to the background thread in runs first.
+*/
+void commitHolds(volume* vol, mbr* MBR){
 	
 	// vars
-	unsigned int MAX_FILES = MBR->disk_size / MBR->cluster_size;
-	bool success = true;
-	unsigned int dir_index = 0;
-	unsigned int file_index = 0;
+	unsigned int start, count;
+	hole_run* run;
 	
-	while(file_table[file_index] != FREE_CLUSTER && file_index != MAX_FILES)
-		file_index++;
+	if(holes.held_len == 0)
+		return;
+	if(!holes.punch){
+		for(unsigned int i = 0; i < holes.held_len; i++)
+			releaseHold(holes.held[i]);
+		holes.held_len = 0;
+		return;
+	}
 	
-	// if the dir_index were to ever be equal, then we somehow filled the disk
-	// with the maximum number of file entries
-	if(MAX_FILES != file_index){
-		
-		// find an available entry in the dir_table ([0] marks the first character
-		// of the name field)
-		while(dir_table[dir_index].name[0] != FREE_CLUSTER && dir_index != MAX_FILES)
-			dir_index++;
-		
-		// write the file name
-		memcpy(dir_table[dir_index].name, name, strlen(name)+1); // nul-byte!
-		
-		// save the file index
-		file_table[file_index] = LAST_CLUSTER;
-		dir_table[dir_index].index = file_index;
-		
-		// setup the size/type/creation meta-data
-		dir_table[dir_index].size = 0;
-		dir_table[dir_index].type = 0x00;
-		dir_table[dir_index].timestamp = time(NULL);
+	// adjacent clusters go out as one run
+	qsort(holes.held, holes.held_len, sizeof(unsigned int), compareClusters);
+	pthread_mutex_lock(&holes.lock);
+	holes.fd = vol->fd;
+	holes.cluster_size = MBR->cluster_size;
+	for(unsigned int i = 0; i < holes.held_len; i += count){
+		start = holes.held[i];
+		for(count = 1; i + count < holes.held_len 
+				&& holes.held[i + count] == start + count; count++);
+		run = (hole_run*)malloc(sizeof(hole_run));
+		run->start = start;
+		run->count = count;
+		run->next = holes.queue;
+		holes.queue = run;
+		holes.pending++;
 	}
-	else{
-		fprintf(stderr, "Woah! No more room for file entries!\n");
-		success = false;
+	holes.held_len = 0;
+	if(!holes.started){
+		holes.started = pthread_create(&holes.thread, NULL, punchHoles, 
+			NULL) == 0;
+		if(holes.started)
+			pthread_detach(holes.thread);
 	}
+	pthread_cond_signal(&holes.work);
+	pthread_mutex_unlock(&holes.lock);
 	
-	return success;
+	// no thread, no punching; the clusters are free all the same
+	if(!holes.started){
+		holes.punch = false;
+		collectHoles(false);
+	}
 }
 
-void printFile(mbr * MBR, unsigned int * file_table, directory * dir_table,
-		char* filename, FILE* filesystem){
+/*
+* Hands back every run the background thread has finished with.
+*
+* @param	wait			block until everything queued has been punched
+*/
+void collectHoles(bool wait){
 	
 	// vars
-	unsigned int dir_loc = findDirectoryIndexOfFile(dir_table, filename),
-		read_index = dir_table[dir_loc].index,
-		cluster_size = MBR->cluster_size;
-	int size = dir_table[dir_loc].size;
-	char buf[cluster_size];
-	memset(buf, 0, sizeof(buf));
+	hole_run* run;
 	
-	// initial read
-	int readOff = cluster_size;
+	if(holes.waiting == 0)
+		return;
+	pthread_mutex_lock(&holes.lock);
 	
-	// read in all linked clusters
-	while(size != 0){
-		
-		if(size > cluster_size)
-			size -= cluster_size;
-		else{
-			readOff = size;
-			size = 0;
+	// without a thread, queued runs are simply given back
+	if(!holes.started){
+		while(holes.queue != NULL){
+			run = holes.queue;
+			holes.queue = run->next;
+			run->next = holes.done;
+			holes.done = run;
+			holes.pending--;
 		}
-		
-		cerr << read_index*cluster_size << endl;
-		
-		readCluster(MBR, buf, read_index, readOff, filesystem);
-		cout << buf;
-		read_index = file_table[read_index];
 	}
-	cout << endl;
-	fflush(stdout);
-}
-	
-
-unsigned int findFreeCluster(mbr * MBR, unsigned int * file_table){
-	unsigned int file_index = 0, 
-		MAX_FILES = MBR->disk_size / MBR->cluster_size;
-	while(file_table[file_index] != FREE_CLUSTER && file_index != MAX_FILES)
-		file_index++;
+	while(wait && holes.pending != 0)
+		pthread_cond_wait(&holes.idle, &holes.lock);
+	run = holes.done;
+	holes.done = NULL;
+	pthread_mutex_unlock(&holes.lock);
 	
-	return file_index;
+	while(run != NULL){
+		hole_run* next = run->next;
+		for(unsigned int i = 0; i < run->count; i++)
+			releaseHold(run->start + i);
+		free(run);
+		run = next;
+	}
 }
 
-unsigned int findFreeDirEntry(mbr* MBR, directory* dir_table){
-	unsigned int MAX_FILES = MBR->disk_size / MBR->cluster_size,
-		dir_index = 0;
-	while(dir_table[dir_index].name[0] != FREE_CLUSTER && dir_index != MAX_FILES)
-			dir_index++;
+/*
+* The background thread: punches each queued run out of the image so the
+* host gets the space back.  It only ever touches clusters the allocator is
+* holding back, so it needs nothing but the queue lock.
+*/
+void* punchHoles(void*){
 	
-	return dir_index;
+	// vars
+	hole_run* run;
+	int result;
+	
+	pthread_mutex_lock(&holes.lock);
+	while(true){
+		while(holes.queue == NULL)
+			pthread_cond_wait(&holes.work, &holes.lock);
+		run = holes.queue;
+		holes.queue = run->next;
+		pthread_mutex_unlock(&holes.lock);
+		
+		result = fallocate(holes.fd, 
+			FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+			(off_t)run->start * holes.cluster_size, 
+			(off_t)run->count * holes.cluster_size);
+		
+		pthread_mutex_lock(&holes.lock);
+		if(result == 0)
+			holes.punched += run->count;
+		else
+			holes.failed += run->count;
+		run->next = holes.done;
+		holes.done = run;
+		if(--holes.pending == 0)
+			pthread_cond_broadcast(&holes.idle);
+	}
+	return NULL;
 }
 
-unsigned int findTotalFreeClusterCount(){
-
+int compareClusters(const void* a, const void* b){
+	unsigned int x = *(unsigned int*)a, y = *(unsigned int*)b;
+	return x < y ? -1 : x > y;
 }
 
 void clearInput(){